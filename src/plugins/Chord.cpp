@@ -0,0 +1,228 @@
+#include <kaleidoscope/keyswitch_state.h>
+#include "Chord.h"
+
+using namespace kaleidoscope;
+
+namespace custom {
+
+const ChordDef* Chord::chords = nullptr;
+uint8_t Chord::chord_cnt = 0;
+uint8_t Chord::members[MEMBER_SIZE] = { 0 };
+millis_offset_t Chord::timeout_ms = CAL_CHORD_TIMEOUT;
+
+Chord::State Chord::state = Chord::State::IDLE;
+uint16_t Chord::first_pos = 0;
+uint16_t Chord::pressed[MAX_KEYS];
+uint8_t Chord::pressed_cnt = 0;
+Chord::chord_mask_t Chord::candidates = 0;
+uint8_t Chord::complete = NO_CHORD;
+uint8_t Chord::held = 0;
+
+EventHandlerResult Chord::setChords(const ChordDef* defs, uint8_t count) {
+  if (count > MAX_CHORDS) {
+    return EventHandlerResult::ERROR;
+  }
+
+  chords = defs;
+  chord_cnt = count;
+
+  memset(members, 0, sizeof(members));
+  for (uint8_t i = 0; i < count; i++) {
+    for (uint16_t p : defs[i].pos) {
+      if (p < ROWS * COLS) {
+        members[p / 8] |= 1 << (p % 8);
+      }
+    }
+  }
+
+  return EventHandlerResult::OK;
+}
+
+EventHandlerResult Chord::onKeyswitchEvent(Key &mappedKey, uint8_t row, uint8_t col, uint8_t keyState) {
+  if (row >= ROWS || col >= COLS) {
+    // Injected (e.g. by a macro), not a real position.
+    return EventHandlerResult::OK;
+  }
+
+  uint16_t p = pos(row, col);
+
+  switch (state) {
+    case State::IDLE:
+      if (!keyToggledOn(keyState) || !is_member(p)) {
+        // Everything else passes through without delay.
+        return EventHandlerResult::OK;
+      }
+
+      // Set up before IQueue shows the press to `should_stop`.
+      state = State::PENDING;
+      first_pos = p;
+      pressed_cnt = 0;
+      candidates = (chord_mask_t)((1ul << chord_cnt) - 1);
+      complete = NO_CHORD;
+
+      if (IQueue::start_queue(timeout_ms, should_stop, mappedKey, row, col, keyState) != EventHandlerResult::OK) {
+        // Another session is already recording or replaying, this press is not
+        // treated as part of a chord.
+        state = State::IDLE;
+        return EventHandlerResult::OK;
+      }
+      return EventHandlerResult::EVENT_CONSUMED;
+    case State::PENDING:
+      if (p == first_pos && keyToggledOn(keyState)) {
+        // The session ended, and its replay starts with the deferred first press.
+        return activate(mappedKey, p, keyState);
+      }
+
+      // Later events of the cycle that started the session must not overtake it.
+      if ((keyToggledOn(keyState) || keyToggledOff(keyState))
+          && IQueue::defer_event(mappedKey, row, col, keyState) == EventHandlerResult::OK) {
+        return EventHandlerResult::EVENT_CONSUMED;
+      }
+      return EventHandlerResult::OK;
+    case State::ACTIVE:
+      return active_event(mappedKey, p, keyState);
+    default:
+      return EventHandlerResult::ERROR;
+  }
+}
+
+bool Chord::should_stop(Key key, uint8_t row, uint8_t col, uint8_t keyState) {
+  if (state != State::PENDING) {
+    return true;
+  }
+
+  uint16_t p = pos(row, col);
+
+  if (keyToggledOff(keyState)) {
+    // Releasing a key of the chord before it's complete ends it.
+    return is_pressed(p);
+  }
+
+  if (!keyToggledOn(keyState)) {
+    return false;
+  }
+
+  if (!add_pressed(p)) {
+    // Not part of any remaining chord, so none can be completed anymore.
+    return true;
+  }
+
+  // Wait while a larger chord could still be completed.
+  bool larger = false;
+  for (uint8_t i = 0; i < chord_cnt; i++) {
+    if (!(candidates & (1 << i))) {
+      continue;
+    }
+
+    if (chord_size(chords[i]) == pressed_cnt) {
+      complete = i;
+    } else {
+      larger = true;
+    }
+  }
+
+  return !larger;
+}
+
+bool Chord::add_pressed(uint16_t p) {
+  if (pressed_cnt == MAX_KEYS) {
+    return false;
+  }
+
+  chord_mask_t next = 0;
+  for (uint8_t i = 0; i < chord_cnt; i++) {
+    if ((candidates & (1 << i)) && chord_key_idx(chords[i], p) >= 0) {
+      next |= 1 << i;
+    }
+  }
+
+  if (next == 0) {
+    return false;
+  }
+
+  candidates = next;
+  pressed[pressed_cnt++] = p;
+  return true;
+}
+
+bool Chord::is_pressed(uint16_t p) {
+  for (uint8_t i = 0; i < pressed_cnt; i++) {
+    if (pressed[i] == p) {
+      return true;
+    }
+  }
+  return false;
+}
+
+EventHandlerResult Chord::activate(Key &mappedKey, uint16_t p, uint8_t keyState) {
+  if (complete == NO_CHORD) {
+    // Replay the keys as they are.
+    state = State::IDLE;
+    return EventHandlerResult::OK;
+  }
+
+  state = State::ACTIVE;
+  held = (uint8_t)((1 << chord_size(chords[complete])) - 1);
+  return active_event(mappedKey, p, keyState);
+}
+
+EventHandlerResult Chord::active_event(Key &mappedKey, uint16_t p, uint8_t keyState) {
+  const ChordDef& def = chords[complete];
+  int8_t key_idx = chord_key_idx(def, p);
+
+  if (key_idx < 0 || !(held & (1 << key_idx))) {
+    return EventHandlerResult::OK;
+  }
+
+  if (keyToggledOff(keyState)) {
+    held &= ~(1 << key_idx);
+    if (held == 0) {
+      state = State::IDLE;
+    }
+  }
+
+  if (p == first_pos) {
+    mappedKey = def.key;
+    return EventHandlerResult::OK;
+  }
+
+  return EventHandlerResult::EVENT_CONSUMED;
+}
+
+uint8_t Chord::chord_size(const ChordDef& def) {
+  uint8_t size = 0;
+  for (uint16_t p : def.pos) {
+    if (p != NO_POS) {
+      size += 1;
+    }
+  }
+  return size;
+}
+
+int8_t Chord::chord_key_idx(const ChordDef& def, uint16_t p) {
+  // Unused positions are at the end.
+  for (uint8_t i = 0; i < MAX_KEYS && def.pos[i] != NO_POS; i++) {
+    if (def.pos[i] == p) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+#ifdef CAL_TEST
+void Chord::reset() {
+  chords = nullptr;
+  chord_cnt = 0;
+  memset(members, 0, sizeof(members));
+  timeout_ms = CAL_CHORD_TIMEOUT;
+  state = State::IDLE;
+  pressed_cnt = 0;
+  candidates = 0;
+  complete = NO_CHORD;
+  held = 0;
+}
+#endif
+
+}
+
+custom::Chord Chord;
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <kaleidoscope/plugin.h>
+#include <kaleidoscope/key_defs.h>
+#include <Kaleidoscope.h>
+#include "IQueue.h"
+
+/// Maximum number of positions of a single chord.
+#ifndef CAL_CHORD_MAX_KEYS
+#define CAL_CHORD_MAX_KEYS 3
+#endif
+
+/// Maximum number of chords.
+#ifndef CAL_CHORD_MAX_CHORDS
+#define CAL_CHORD_MAX_CHORDS 16
+#endif
+
+/// Default time (in ms) to wait for the rest of a chord after its first key.
+#ifndef CAL_CHORD_TIMEOUT
+#define CAL_CHORD_TIMEOUT 50
+#endif
+
+namespace custom {
+
+using namespace kaleidoscope;
+
+/// Positions which, pressed together, emit `key`.
+struct ChordDef {
+  /// Positions (`row * COLS + col`, see `Chord::pos`), unused ones are `Chord::NO_POS`
+  /// and come last.
+  uint16_t pos[CAL_CHORD_MAX_KEYS];
+  Key key;
+};
+
+/// Key chords without a delay on every keystroke: Only a press of a position that is
+/// part of some chord starts an IQueue session, which ends as soon as a chord is
+/// complete or can't be completed anymore. All other keys pass through immediately.
+///
+/// The chord key is pressed in place of the first key of the chord, and released
+/// with it. The other keys of the chord are ignored until they are released.
+///
+/// Must be initialized after IQueue.
+class Chord : public Plugin {
+  friend class ChordTest;
+
+  public:
+    static constexpr uint16_t NO_POS = 0xFFFF;
+
+    static constexpr uint16_t pos(uint8_t row, uint8_t col) {
+      return (uint16_t)row * COLS + col;
+    }
+
+    /// Use the chords of `defs` (which must outlive the plugin). Fails if there are more
+    /// than `CAL_CHORD_MAX_CHORDS`.
+    static EventHandlerResult setChords(const ChordDef* defs, uint8_t count);
+
+    /// Set how long to wait for the rest of a chord after its first key.
+    static void setTimeout(millis_offset_t timeout) {
+      timeout_ms = timeout;
+    }
+
+    EventHandlerResult onKeyswitchEvent(Key &mappedKey, uint8_t row, uint8_t col, uint8_t keyState);
+
+    enum class State : uint8_t {
+      /// No chord key pressed.
+      IDLE = 0,
+      /// Recording, waiting for the chord to be complete or impossible.
+      PENDING,
+      /// A chord is held, waiting for all of its keys to be released.
+      ACTIVE,
+    };
+
+  private:
+    typedef uint16_t chord_mask_t;
+
+    static constexpr uint8_t MAX_KEYS = CAL_CHORD_MAX_KEYS;
+    static constexpr uint8_t MAX_CHORDS = CAL_CHORD_MAX_CHORDS;
+    static constexpr uint8_t NO_CHORD = 0xFF;
+
+    static_assert (MAX_CHORDS <= sizeof(chord_mask_t) * 8, "CAL_CHORD_MAX_CHORDS must fit a bitset.");
+    static_assert (MAX_KEYS <= 8, "CAL_CHORD_MAX_KEYS must fit a bitset.");
+
+    static constexpr size_t MEMBER_SIZE = (ROWS * COLS + 7) / 8;
+
+    static const ChordDef* chords;
+    static uint8_t chord_cnt;
+    /// Bitset of positions which are part of some chord.
+    static uint8_t members[MEMBER_SIZE];
+    static millis_offset_t timeout_ms;
+
+    static State state;
+    /// Position of the first key, which emits the chord key.
+    static uint16_t first_pos;
+    /// Positions pressed since the first key (including it).
+    static uint16_t pressed[MAX_KEYS];
+    static uint8_t pressed_cnt;
+    /// Chords which contain all pressed positions.
+    static chord_mask_t candidates;
+    /// The candidate with all of its positions pressed, if any.
+    static uint8_t complete;
+    /// Keys (indexes into the definition) of the active chord which are still held.
+    static uint8_t held;
+
+    static bool should_stop(Key key, uint8_t row, uint8_t col, uint8_t keyState);
+    static bool add_pressed(uint16_t pos);
+    static bool is_pressed(uint16_t pos);
+    static EventHandlerResult activate(Key &mappedKey, uint16_t pos, uint8_t keyState);
+    static EventHandlerResult active_event(Key &mappedKey, uint16_t pos, uint8_t keyState);
+
+    static uint8_t chord_size(const ChordDef& def);
+    static int8_t chord_key_idx(const ChordDef& def, uint16_t pos);
+
+    static bool is_member(uint16_t pos) {
+      return (members[pos / 8] >> (pos % 8)) & 1;
+    }
+
+#ifdef CAL_TEST
+    static void reset();
+#endif
+};
+
+}
+
+extern custom::Chord Chord;
@@ -0,0 +1,49 @@
+#include "Deadlines.h"
+
+namespace custom {
+
+Deadlines::tick_t Deadlines::deadlines[SLOT_CNT] = { 0 };
+uint8_t Deadlines::armed_bits = 0;
+Deadlines::tick_t Deadlines::earliest = 0;
+
+void Deadlines::setEarlier(DeadlineSlot slot, tick_t deadline) {
+  tick_t& current = deadlines[(uint8_t)slot];
+
+  if (armed(slot) && !passed(deadline, current)) {
+    // Not earlier than the armed one.
+    return;
+  }
+
+  bool others = (armed_bits & ~slot_bit(slot)) != 0;
+  current = deadline;
+  armed_bits |= slot_bit(slot);
+
+  if (!others || passed(deadline, earliest)) {
+    earliest = deadline;
+  }
+}
+
+void Deadlines::clear(DeadlineSlot slot) {
+  armed_bits &= ~slot_bit(slot);
+
+  bool first = true;
+  for (uint8_t idx = 0; idx < SLOT_CNT; idx++) {
+    if (!(armed_bits & (1 << idx))) {
+      continue;
+    }
+    if (first || passed(deadlines[idx], earliest)) {
+      earliest = deadlines[idx];
+      first = false;
+    }
+  }
+}
+
+#ifdef CAL_TEST
+void Deadlines::reset() {
+  memset(deadlines, 0, sizeof(deadlines));
+  armed_bits = 0;
+  earliest = 0;
+}
+#endif
+
+}
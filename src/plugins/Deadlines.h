@@ -0,0 +1,74 @@
+#pragma once
+
+#include <Kaleidoscope.h>
+
+namespace custom {
+
+/// Owners of a `Deadlines` slot, one per plugin.
+enum class DeadlineSlot : uint8_t {
+  TAPMOD = 0,
+  IQUEUE,
+  REPORT_GATE,
+  COUNT,
+};
+
+/// Shared timer service with 16 bit ticks (milliseconds, wrapping every ~65 s), which are
+/// cheaper than `millis()` arithmetic on AVR. Each slot holds the earliest deadline of
+/// its owner, so asking whether anything expired is O(1), and owners only walk their
+/// own timers once it did. Deadlines must be less than 32 s ahead.
+class Deadlines {
+  public:
+    typedef uint16_t tick_t;
+
+    /// The tick of the current cycle.
+    static tick_t now() {
+      return (tick_t)kaleidoscope::Kaleidoscope_::millisAtCycleStart();
+    }
+
+    static tick_t tick(unsigned long ms) {
+      return (tick_t)ms;
+    }
+
+    /// Whether `deadline` passed at `now`, i.e. `now` is later (wrap-safe).
+    static bool passed(tick_t deadline, tick_t now) {
+      return (int16_t)(tick_t)(now - deadline) > 0;
+    }
+
+    /// Arm `slot` with `deadline`, unless it's armed with an earlier one already.
+    static void setEarlier(DeadlineSlot slot, tick_t deadline);
+
+    static void clear(DeadlineSlot slot);
+
+    static bool armed(DeadlineSlot slot) {
+      return armed_bits & slot_bit(slot);
+    }
+
+    /// Whether `slot` is armed and its deadline passed at `now`.
+    static bool expired(DeadlineSlot slot, tick_t now) {
+      return armed(slot) && passed(deadlines[(uint8_t)slot], now);
+    }
+
+    /// Whether any slot is armed and its deadline passed at `now`.
+    static bool anyExpired(tick_t now) {
+      return armed_bits != 0 && passed(earliest, now);
+    }
+
+#ifdef CAL_TEST
+    static void reset();
+#endif
+
+  private:
+    static constexpr uint8_t SLOT_CNT = (uint8_t)DeadlineSlot::COUNT;
+    static_assert (SLOT_CNT <= 8, "DeadlineSlot must fit a bitset.");
+
+    static tick_t deadlines[SLOT_CNT];
+    static uint8_t armed_bits;
+    /// The earliest deadline of all armed slots.
+    static tick_t earliest;
+
+    static uint8_t slot_bit(DeadlineSlot slot) {
+      return 1 << (uint8_t)slot;
+    }
+};
+
+}
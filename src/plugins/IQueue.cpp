@@ -1,24 +1,74 @@
-#include <kaleidoscope/addr.h>
 #include <Kaleidoscope.h>
 #include "IQueue.h"
+#include "ReportGate.h"
+
+#if CAL_IQUEUE_FOCUS
+#include <Kaleidoscope-FocusSerial.h>
+#endif
 
 using namespace kaleidoscope;
 
 namespace custom {
 
-IQueue::QWord IQueue::queue[QUEUE_SIZE] =  { 0 };
+IQueue::QByte IQueue::queue[QUEUE_SIZE] =  { 0 };
 size_t IQueue::queue_head = 0;
 size_t IQueue::queue_len = 0;
+size_t IQueue::commit_end = 0;
+
+size_t IQueue::last_run_idx = QUEUE_SIZE;
+millis_offset_t IQueue::last_run_delta = 0;
+uint8_t IQueue::update_cnt = 0;
 
 IQueue::Flag IQueue::flags[ROWS * COLS];
+uint8_t IQueue::active[ACTIVE_SIZE];
 Key IQueue::key_overrides[ROWS * COLS];
 
 IQueue::State IQueue::state = IQueue::State::IDLE;
-IQueueShouldStop IQueue::stop_fn = nullptr;
-ts_millis_t IQueue::deadline = 0;
-bool IQueue::should_stop = false;
-bool IQueue::did_update = false;
+IQueue::Requester IQueue::requesters[MAX_REQUESTERS];
+uint8_t IQueue::requester_cnt = 0;
+uint8_t IQueue::requesters_done = 0;
+bool IQueue::chain_pending = false;
+bool IQueue::evaluating = false;
+size_t IQueue::eval_idx = 0;
+size_t IQueue::eval_cycle_end = 0;
+IQueue::Deferred IQueue::deferred[MAX_DEFERRED];
+uint8_t IQueue::deferred_cnt = 0;
+bool IQueue::should_commit = false;
 bool IQueue::should_record_cycle = false;
+bool IQueue::scanning = false;
+bool IQueue::record_done = false;
+
+IQueue::RecordMode IQueue::record_mode = IQueue::RecordMode::BLOCKING;
+IQueue::ReplayMode IQueue::replay_mode = IQueue::ReplayMode::IMMEDIATE;
+ts_millis_t IQueue::last_ts = 0;
+ts_millis_t IQueue::scan_ts = 0;
+millis_offset_t IQueue::scan_delta = 0;
+size_t IQueue::scan_cycle_start = 0;
+size_t IQueue::scan_updates_start = 0;
+
+uint8_t IQueue::scan_interval_ms = CAL_IQUEUE_SCAN_INTERVAL;
+uint16_t IQueue::session_scans = 0;
+ts_millis_t IQueue::replay_ts = 0;
+uint8_t IQueue::replay_run_left = 0;
+millis_offset_t IQueue::replay_run_delta = 0;
+
+uint8_t IQueue::replay_interval_ms = CAL_IQUEUE_REPLAY_INTERVAL;
+ts_millis_t IQueue::last_replay_ms = 0;
+
+bool IQueue::coalesce_replay = false;
+IQueueOnSkippedCycle IQueue::on_skipped_cycle = nullptr;
+
+const uint8_t* IQueue::macro_next = nullptr;
+const uint8_t* IQueue::macro_end = nullptr;
+IQueue::MacroKey IQueue::macro_keys[MACRO_KEYS];
+uint8_t IQueue::macro_interval_ms = CAL_IQUEUE_REPLAY_INTERVAL;
+ts_millis_t IQueue::macro_ts = 0;
+ts_millis_t IQueue::macro_wait_ms = 0;
+uint8_t IQueue::macro_updates = 0;
+
+ts_millis_t IQueue::record_start_ts = 0;
+
+IQueue::Metrics IQueue::session_metrics = { 0 };
 
 #ifdef CAL_TEST
 bool IQueue::stop_after_record = false;
@@ -30,54 +80,237 @@ EventHandlerResult IQueue::beforeEachCycle() {
     case State::REPLAY:
       return EventHandlerResult::OK;
     case State::PREPARING:
+      state = State::RECORD;
+      begin_record(millis());
+
+      if (all_requesters_done()) {
+        // Decided by the deferred events alone, just replay them.
+        session_metrics.stop_endings += 1;
+        return finish_session();
+      }
+
+      if (record_mode == RecordMode::BLOCKING) {
+        record_blocking();
+        return finish_session();
+      }
       break;
+    case State::RECORD:
+      // Only reachable in cooperative mode, continue the session.
+      if (should_commit) {
+        commit();
+      }
+
+      if (record_done) {
+        return finish_session();
+      }
+      break;
+    case State::DRAIN:
+      if (record_done) {
+        // A live scan was lost, don't wait any longer.
+        return flush();
+      }
+      break;
+    case State::MACRO:
+      return macro_cycle();
     default:
       return EventHandlerResult::ERROR;
   }
 
-  state = State::RECORD;
-  memset(flags, 0, sizeof(flags));
+  return live_cycle();
+}
 
-  ts_millis_t base_ts = millis();
+EventHandlerResult IQueue::beforeReportingState() {
+  if (state == State::MACRO) {
+    macro_events();
+    return EventHandlerResult::OK;
+  }
+
+  if ((state != State::RECORD && state != State::DRAIN) || !scanning) {
+    return EventHandlerResult::OK;
+  }
+
+  scanning = false;
+
+  // The session is finished at the start of the next cycle, so the replay does not
+  // run nested in the middle of this one.
+  if (!end_scan(scan_ts)) {
+    record_done = true;
+  }
+
+  if (state == State::DRAIN) {
+    // Nobody is left to decide, live scans are replayed as they are.
+    commit_end = queue_len;
+  }
+
+  // Keys pressed by replayed cycles (including the paced one of this cycle) are part
+  // of the live report.
+  replay_events();
+
+  if (chain_pending && !chain_session()) {
+    // Keep recording live scans for the chained session.
+    state = State::RECORD;
+  }
+
+  return EventHandlerResult::OK;
+}
+
+EventHandlerResult IQueue::live_cycle() {
+  // Record the scan of this cycle.
+  ts_millis_t ts = millis();
+
+  if (state == State::DRAIN && queue_head == commit_end && replay_run_left == 0) {
+    // Everything has been replayed, continue with normal cycles.
+    state = State::IDLE;
+    queue_head = 0;
+    queue_len = 0;
+    commit_end = 0;
+    return EventHandlerResult::OK;
+  }
+
+  if (!begin_scan(ts)) {
+    return state == State::RECORD ? finish_session() : flush();
+  }
+
+  if (replay_mode == ReplayMode::PACED && ts - last_replay_ms >= replay_interval_ms) {
+    if (replay_paced()) {
+      last_replay_ms = ts;
+    }
+  }
+
+  scan_ts = ts;
+  scanning = true;
+  return EventHandlerResult::OK;
+}
 
-  bool needs_new_ts = true;
+void IQueue::record_blocking() {
+  ts_millis_t next_scan_ts = last_ts;
 
   while (true) {
-    ts_millis_t ts = millis();
-    if (ts > deadline) { break; }
+    if (check_deadlines(next_scan_ts)) {
+      session_metrics.deadline_endings += 1;
+      break;
+    }
 
-    if (needs_new_ts) {
-      q_push({ .raw = (millis_offset_t)(ts - base_ts) });
-    } else {
-      q_peek_last().raw = (millis_offset_t)(ts - base_ts);
+    // Idle until the next scan is due, instead of scanning as fast as possible.
+    ts_millis_t ts = millis();
+    if (ts < next_scan_ts) {
+      delay(next_scan_ts - ts);
+      ts = millis();
     }
 
-    should_stop = false;
-    did_update = false;
-    should_record_cycle = false;
+    next_scan_ts = ts + scan_interval_ms;
+
+    if (!begin_scan(ts)) { break; }
 
     // Will update global state.
+    scanning = true;
     KeyboardHardware.scanMatrix();
+    scanning = false;
 
-    if (should_record_cycle) {
-      if (did_update) {
-        // There was at least one update, so set the flag on that.
-        q_peek_last().is_last_update = true;
-      } else {
-        // No explicit updates, set the flag.
-        q_peek_last().no_explicit_updates = true;
-      }
-      // In any case, a cycle was recorded so need a new ts.
-      needs_new_ts = true;
-    } else {
-      // Cycle should not be recorded, reuse the ts.
-      needs_new_ts = false;
+    if (!end_scan(ts)) { break; }
+
+    if (should_commit) {
+      replay_committed();
     }
+  }
+}
 
-    if (should_stop) {
-      break;
+bool IQueue::begin_scan(ts_millis_t ts) {
+  if (state == State::RECORD && check_deadlines(ts)) {
+    session_metrics.deadline_endings += 1;
+    return false;
+  }
+
+  if (queue_head > 0) {
+    compact();
+  }
+
+  scan_delta = ts - last_ts;
+
+  // Updates are recorded after space reserved for the header (including a possible
+  // count byte), and moved down once the actual header size is known.
+  scan_cycle_start = queue_len;
+  scan_updates_start = scan_cycle_start + header_size(scan_delta) + 1;
+
+  if (scan_updates_start + HEADROOM > QUEUE_SIZE) {
+    // Another scan might not fit, so stop recording and replay what we have
+    // instead of losing updates.
+    session_metrics.early_flushes += 1;
+    return false;
+  }
+
+  queue_len = scan_updates_start;
+
+  should_commit = false;
+  should_record_cycle = false;
+  update_cnt = 0;
+
+  return true;
+}
+
+bool IQueue::end_scan(ts_millis_t ts) {
+  session_scans += 1;
+
+  if (should_record_cycle) {
+    record_cycle(scan_cycle_start, scan_updates_start, scan_delta);
+    last_ts = ts;
+    session_metrics.cycles_recorded += 1;
+    if (queue_len > session_metrics.peak_queue_len) {
+      session_metrics.peak_queue_len = queue_len;
     }
+  } else {
+    // Cycle should not be recorded, drop it.
+    queue_len = scan_cycle_start;
+  }
+
+  if (state == State::RECORD && all_requesters_done()) {
+    session_metrics.stop_endings += 1;
+    return false;
   }
+  return true;
+}
+
+void IQueue::commit() {
+  should_commit = false;
+
+  if (replay_mode == ReplayMode::PACED) {
+    // Replayed one cycle at a time by the following cycles. The last run must not
+    // grow by undecided cycles.
+    commit_end = queue_len;
+    last_run_idx = QUEUE_SIZE;
+  } else {
+    replay_committed();
+  }
+}
+
+void IQueue::replay_committed() {
+  // Everything recorded so far is decided, replay it now instead of waiting for
+  // the end of the session.
+  ts_millis_t cycle_start_ts = Kaleidoscope_::millisAtCycleStart();
+
+  state = State::REPLAY;
+  replay();
+  state = State::RECORD;
+
+  should_commit = false;
+  last_run_idx = QUEUE_SIZE;
+  Kaleidoscope_::setMillisAtCycleStart(cycle_start_ts);
+}
+
+void IQueue::end_record() {
+  // The recording is bounded by the deadline, so this fits.
+  millis_offset_t record_ms = millis() - record_start_ts;
+  if (record_ms > session_metrics.max_record_ms) {
+    session_metrics.max_record_ms = record_ms;
+  }
+
+  // However recording ended, nobody is left to decide.
+  requesters_done = (uint8_t)((1 << requester_cnt) - 1);
+  Deadlines::clear(DeadlineSlot::IQUEUE);
+}
+
+EventHandlerResult IQueue::finish_session() {
+  end_record();
 
 #ifdef CAL_TEST
   if (stop_after_record) {
@@ -85,88 +318,610 @@ EventHandlerResult IQueue::beforeEachCycle() {
   }
 #endif
 
-  memset(flags, 0, sizeof(flags));
+  if (replay_mode == ReplayMode::PACED) {
+    return drain();
+  }
+
+  return flush();
+}
+
+EventHandlerResult IQueue::drain() {
+  // Replay over the next cycles, recording their live scans until caught up.
+  state = State::DRAIN;
+  commit_end = queue_len;
+  record_done = false;
+  return live_cycle();
+}
 
+EventHandlerResult IQueue::flush() {
   state = State::REPLAY;
 
-  while (queue_len > 0) {
-    QWord cycle_info = q_pop();
-    Kaleidoscope_::setMillisAtCycleStart(base_ts + cycle_info.millis_offset);
+  while (!replay()) {
+    // A session was requested during the replay, and was not satisfied by the rest
+    // of the queue. Continue recording it.
+    state = State::RECORD;
+    if (record_mode == RecordMode::COOPERATIVE) {
+      return live_cycle();
+    }
 
-    kaleidoscope::Hooks::beforeEachCycle();
+    record_blocking();
+    end_record();
 
-    // Perform any explicit updates.
-    if (!cycle_info.no_explicit_updates) {
-      while (true) {
-        QWord update = q_pop();
+    if (replay_mode == ReplayMode::PACED) {
+      return drain();
+    }
+    state = State::REPLAY;
+  }
 
-        Flag& flag = flags[update.pos_idx];
-        flag.replay_key_state = update.key_state;
+  state = State::IDLE;
 
-        // Once we have the first key down event, we stop using key overrides.
-        if (keyToggledOn(update.key_state)) {
-          flag.replay_no_key_override = true;
-        }
+  // Continue with an actual cycle.
+  Kaleidoscope_::setMillisAtCycleStart(millis());
+  return EventHandlerResult::OK;
+}
 
-        if (update.is_last_update) {
-          break;
-        }
-      }
+void IQueue::compact() {
+  // Paced replay frees space at the front while recording continues at the back.
+  size_t shift = queue_head;
+  memmove(&queue[0], &queue[shift], queue_len - shift);
+
+  queue_head = 0;
+  queue_len -= shift;
+  commit_end -= shift;
+
+  // A run still being extended has not been replayed yet, so it can't be in front
+  // of the head.
+  if (last_run_idx < QUEUE_SIZE) {
+    last_run_idx -= shift;
+  }
+}
+
+size_t IQueue::header_size(millis_offset_t delta) {
+  if (delta < DELTA_EXT) {
+    return 1;
+  }
+
+  size_t size = 2;
+  for (millis_offset_t rest = (delta - DELTA_EXT) >> 7; rest != 0; rest >>= 7) {
+    size += 1;
+  }
+  return size;
+}
+
+void IQueue::record_cycle(size_t cycle_start, size_t updates_start, millis_offset_t delta) {
+  size_t updates_len = queue_len - updates_start;
+
+  queue_len = cycle_start;
+
+  if (update_cnt == 0 && last_run_idx < QUEUE_SIZE && last_run_delta == delta) {
+    // Extend the previous run of cycles without explicit updates. It is always the
+    // last entry, so a count byte can simply be appended.
+    QByte& run = queue[last_run_idx];
+    if (run.count < COUNT_EXT - 1) {
+      run.count += 1;
+      return;
+    } else if (run.count == COUNT_EXT - 1) {
+      q_push(run.count + 2);
+      run.count = COUNT_EXT;
+      return;
+    } else if (queue[queue_len - 1].raw < 0xFF) {
+      queue[queue_len - 1].raw += 1;
+      return;
+    }
+  }
+
+  QByte header = { 0 };
+  header.is_run = update_cnt == 0;
+  header.delta = delta < DELTA_EXT ? delta : DELTA_EXT;
+  if (update_cnt > 0) {
+    header.count = update_cnt <= COUNT_EXT ? update_cnt - 1 : COUNT_EXT;
+  }
+
+  size_t header_idx = queue_len;
+  q_push(header.raw);
+
+  if (delta >= DELTA_EXT) {
+    millis_offset_t rest = delta - DELTA_EXT;
+    do {
+      uint8_t ext = rest & 0x7F;
+      rest >>= 7;
+      q_push(rest != 0 ? ext | 0x80 : ext);
+    } while (rest != 0);
+  }
+
+  if (update_cnt > COUNT_EXT) {
+    q_push(update_cnt);
+  }
+
+  // The header is never larger than the reserved space, so this does not clobber
+  // any updates.
+  if (updates_len > 0) {
+    memmove(&queue[queue_len], &queue[updates_start], updates_len);
+    queue_len += updates_len;
+  }
+
+  if (header.is_run) {
+    last_run_idx = header_idx;
+    last_run_delta = delta;
+  } else {
+    last_run_idx = QUEUE_SIZE;
+  }
+}
+
+void IQueue::record_update(uint16_t pos_idx, uint8_t key_state) {
+  // Callers check that it fits.
+  QByte update = { 0 };
+  size_t size = update_size(pos_idx);
+
+  if (size == 1) {
+    update.pos_idx = pos_idx;
+    update.key_state = key_state;
+    q_push(update.raw);
+  } else if (size == 2) {
+    update.ext_pos_idx_high = pos_idx >> 8;
+    update.ext_key_state = key_state;
+    q_push(update.raw);
+    q_push(pos_idx & 0xFF);
+  } else {
+    update.ext_pos_idx_high = POS_IDX_HIGH_WIDE;
+    update.ext_key_state = key_state;
+    q_push(update.raw);
+    q_push(pos_idx >> 8);
+    q_push(pos_idx & 0xFF);
+  }
+
+  update_cnt += 1;
+}
+
+void IQueue::begin_record(ts_millis_t base_ts) {
+  memset(flags, 0, sizeof(flags));
+  memset(active, 0, sizeof(active));
+  for (Key& key : key_overrides) {
+    key = Key_NoKey;
+  }
+
+  last_run_idx = QUEUE_SIZE;
+  session_scans = 0;
+  session_metrics.sessions += 1;
+  record_start_ts = base_ts;
+  last_ts = base_ts;
+  replay_ts = base_ts;
+  replay_run_left = 0;
+  last_replay_ms = base_ts - replay_interval_ms;
+  commit_end = 0;
+  should_commit = false;
+  record_done = false;
+
+  record_deferred();
+}
+
+void IQueue::record_deferred() {
+  if (deferred_cnt == 0) {
+    return;
+  }
+
+  // Recorded like a scan at the very start of the session.
+  size_t updates_start = header_size(0) + 1;
+  queue_len = updates_start;
+  update_cnt = 0;
+
+  for (uint8_t i = 0; i < deferred_cnt; i++) {
+    Deferred& event = deferred[i];
+    Flag& flag = flags[event.pos_idx];
+
+    if (keyWasPressed(event.key_state)) {
+      key_overrides[event.pos_idx] = event.key;
+    }
+
+    record_update(event.pos_idx, event.key_state);
+    flag.record_key_state = event.key_state;
+  }
+
+  record_cycle(0, updates_start, 0);
+  session_metrics.cycles_recorded += 1;
+  deferred_cnt = 0;
+}
+
+bool IQueue::replay() {
+  unsigned long start_us = micros();
+  commit_end = queue_len;
+  bool complete = true;
+
+  uint8_t updates;
+  while (next_cycle(updates)) {
+    if (updates == 0 && skip_cycle(replay_ts)) {
+      continue;
+    }
+    replay_cycle(replay_ts);
+    session_metrics.cycles_replayed += 1;
+
+    if (chain_pending && !chain_session()) {
+      complete = false;
+      break;
+    }
+  }
+
+  if (complete) {
+    queue_head = 0;
+    queue_len = 0;
+    commit_end = 0;
+  }
+
+  unsigned long replay_us = micros() - start_us;
+  if (replay_us > session_metrics.max_replay_us) {
+    session_metrics.max_replay_us = replay_us < 0xFFFF ? replay_us : 0xFFFF;
+  }
+
+  return complete;
+}
+
+bool IQueue::chain_session() {
+  chain_pending = false;
+  session_metrics.sessions += 1;
+  record_start_ts = millis();
+
+  if (evaluate_queued()) {
+    // Decided right away, keep replaying.
+    return true;
+  }
+
+  // The rest of the queue is the undecided start of the new session. Record and replay
+  // state of all keys stay valid, since nothing was scanned.
+  compact();
+  commit_end = 0;
+  last_run_idx = QUEUE_SIZE;
+  return false;
+}
+
+bool IQueue::evaluate_queued() {
+  State replay_state = state;
+  ts_millis_t cycle_start_ts = Kaleidoscope_::millisAtCycleStart();
+
+  state = State::RECORD;
+  evaluating = true;
+  // Allow rewriting the queued cycles.
+  size_t decided_end = commit_end;
+  commit_end = queue_head;
+
+  // The rest of a partially replayed run has no updates, only time passes.
+  ts_millis_t ts = replay_ts + (ts_millis_t)replay_run_left * replay_run_delta;
+  bool done = check_deadlines(ts);
+
+  eval_idx = queue_head;
+  while (!done && eval_idx < queue_len) {
+    QByte header = queue[eval_idx++];
+    millis_offset_t delta = q_read_delta(eval_idx, header);
+    uint8_t count = header.count == COUNT_EXT ? queue[eval_idx++].raw : header.count + 1;
+
+    if (header.is_run) {
+      ts += (ts_millis_t)delta * count;
+      done = check_deadlines(ts);
+      continue;
+    }
+
+    ts += delta;
+    if (check_deadlines(ts)) {
+      done = true;
+      break;
+    }
+
+    // The requesters may drop updates, which moves the rest of the queue.
+    eval_cycle_end = eval_idx;
+    for (; count > 0; count--) {
+      eval_cycle_end += update_size(queue[eval_cycle_end]);
+    }
+
+    Kaleidoscope_::setMillisAtCycleStart(ts);
+    while (eval_idx < eval_cycle_end) {
+      QByte update = queue[eval_idx];
+      uint16_t pos_idx = update_pos_idx(eval_idx);
+      uint8_t key_state = update.key_state != 0 ? update.key_state : update.ext_key_state;
+      eval_idx += update_size(update);
+
+      // Same as during recording: Held keys use the key seen back then, everything
+      // else is looked up.
+      Flag& flag = flags[pos_idx];
+      bool use_override = flag.replay_key_rewritten || (keyIsPressed(key_state) && keyWasPressed(key_state));
+      handleKeyswitchEvent(use_override ? key_overrides[pos_idx] : Key_NoKey,
+                           pos_row(pos_idx), pos_col(pos_idx), key_state);
+    }
+
+    done = all_requesters_done();
+  }
+
+  if (done) {
+    commit_end = decided_end;
+  }
+
+  evaluating = false;
+  state = replay_state;
+  Kaleidoscope_::setMillisAtCycleStart(cycle_start_ts);
+  return done;
+}
+
+bool IQueue::replay_paced() {
+  ts_millis_t cycle_start_ts = Kaleidoscope_::millisAtCycleStart();
+
+  uint8_t updates;
+  while (next_cycle(updates)) {
+    if (updates == 0 && skip_cycle(replay_ts)) {
+      continue;
+    }
+
+    // The events are triggered from `beforeReportingState`, the rest of this cycle
+    // already runs at the replayed time.
+    Kaleidoscope_::setMillisAtCycleStart(replay_ts);
+    session_metrics.cycles_replayed += 1;
+    return true;
+  }
+
+  Kaleidoscope_::setMillisAtCycleStart(cycle_start_ts);
+  return false;
+}
+
+bool IQueue::next_cycle(uint8_t& updates) {
+  if (replay_run_left == 0) {
+    if (queue_head >= commit_end) {
+      return false;
+    }
+
+    QByte header = q_pop();
+    millis_offset_t delta = q_pop_delta(header);
+
+    uint8_t count = header.count == COUNT_EXT ? q_pop().raw : header.count + 1;
+
+    if (!header.is_run) {
+      replay_ts += delta;
+      apply_updates(count);
+      updates = count;
+      return true;
+    }
+
+    replay_run_left = count;
+    replay_run_delta = delta;
+  }
+
+  replay_run_left -= 1;
+  replay_ts += replay_run_delta;
+  updates = 0;
+  return true;
+}
+
+bool IQueue::skip_cycle(ts_millis_t ts) {
+  // Without explicit updates the set of pressed keys is the same as in the previous
+  // cycle, so the report would be too.
+  if (!coalesce_replay) {
+    return false;
+  }
+
+  if (on_skipped_cycle != nullptr) {
+    Kaleidoscope_::setMillisAtCycleStart(ts);
+    if (on_skipped_cycle(ts)) {
+      return false;
     }
+  }
+
+  return true;
+}
+
+void IQueue::replay_cycle(ts_millis_t ts) {
+  Kaleidoscope_::setMillisAtCycleStart(ts);
+
+  kaleidoscope::Hooks::beforeEachCycle();
+
+  replay_events();
+
+  kaleidoscope::Hooks::beforeReportingState();
+
+  ReportGate::send();
+  kaleidoscope::hid::releaseAllKeys();
+
+  kaleidoscope::Hooks::afterEachCycle();
+}
+
+void IQueue::apply_updates(uint8_t updates) {
+  for (; updates > 0; updates--) {
+    QByte update = queue[queue_head];
+    pos_idx_t pos_idx = update_pos_idx(queue_head);
+    uint8_t key_state = update.key_state != 0 ? update.key_state : update.ext_key_state;
+    queue_head += update_size(update);
 
-    // Trigger the key events.
-    for (uint8_t idx = 0; idx < ROWS * COLS; idx++) {
+    Flag& flag = flags[pos_idx];
+    flag.replay_key_state = key_state;
+
+    if (key_state != 0) {
+      set_active(pos_idx);
+    } else {
+      clear_active(pos_idx);
+    }
+
+    // Once we have the first key down event, we stop using key overrides.
+    if (keyToggledOn(key_state)) {
+      flag.replay_no_key_override = true;
+    }
+  }
+}
+
+void IQueue::replay_events() {
+  // Trigger the key events, only visiting positions with a non-zero key state
+  // (in position order, same as a real scan).
+  for (size_t byte_idx = 0; byte_idx < ACTIVE_SIZE; byte_idx++) {
+    uint8_t bits = active[byte_idx];
+
+    while (bits != 0) {
+      uint8_t bit = __builtin_ctz(bits);
+      bits &= bits - 1;
+
+      pos_idx_t idx = byte_idx * 8 + bit;
       Flag& flag = flags[idx];
 
-      if (flag.raw != 0 && flag.replay_key_state != 0) {
-        handleKeyswitchEvent(
-            flag.replay_no_key_override ? Key_NoKey : key_overrides[idx],
-            kaleidoscope::addr::row(idx), kaleidoscope::addr::col(idx),
-            flag.replay_key_state);
-
-        if (keyToggledOn(flag.replay_key_state)) {
-          flag.replay_key_state = WAS_PRESSED | IS_PRESSED;
-        } else if (keyToggledOff(flag.replay_key_state)) {
-          flag.replay_key_state = 0;
-        }
+      handleKeyswitchEvent(
+          flag.replay_no_key_override && !flag.replay_key_rewritten ? Key_NoKey : key_overrides[idx],
+          pos_row(idx), pos_col(idx),
+          flag.replay_key_state);
+
+      if (keyToggledOn(flag.replay_key_state)) {
+        flag.replay_key_state = WAS_PRESSED | IS_PRESSED;
+      } else if (keyToggledOff(flag.replay_key_state)) {
+        flag.replay_key_state = 0;
+        clear_active(idx);
       }
     }
+  }
+}
 
-    kaleidoscope::Hooks::beforeReportingState();
+EventHandlerResult IQueue::play_macro(const uint8_t* macro, uint16_t len) {
+  if (state != State::IDLE) {
+    return EventHandlerResult::ERROR;
+  }
+
+  state = State::MACRO;
+  macro_next = macro;
+  macro_end = macro + len;
+  memset(macro_keys, 0, sizeof(macro_keys));
+  macro_ts = Kaleidoscope_::millisAtCycleStart();
+  macro_wait_ms = 0;
+  macro_updates = 0;
+  return EventHandlerResult::OK;
+}
 
-    kaleidoscope::hid::sendKeyboardReport();
-    kaleidoscope::hid::releaseAllKeys();
+EventHandlerResult IQueue::macro_cycle() {
+  if (macro_updates == 0 && !macro_next_cycle()) {
+    bool held = false;
+    for (MacroKey& key : macro_keys) {
+      if (key.key_state != 0) {
+        // Don't leave keys of an incomplete macro pressed.
+        key.key_state = WAS_PRESSED;
+        held = true;
+      }
+    }
 
-    kaleidoscope::Hooks::afterEachCycle();
+    if (!held) {
+      state = State::IDLE;
+    }
+    return EventHandlerResult::OK;
   }
 
-  state = State::IDLE;
+  ts_millis_t ts = Kaleidoscope_::millisAtCycleStart();
+  if (ts - macro_ts < macro_wait_ms) {
+    return EventHandlerResult::OK;
+  }
 
-  // Continue with an actual cycle.
-  Kaleidoscope_::setMillisAtCycleStart(millis());
+  macro_apply_updates();
+  macro_ts = ts;
   return EventHandlerResult::OK;
 }
 
+bool IQueue::macro_next_cycle() {
+  macro_wait_ms = 0;
+
+  while (macro_next < macro_end) {
+    MacroReader reader { macro_next };
+    QByte header = reader.next();
+    millis_offset_t delta = read_delta(reader, header);
+    uint8_t count = read_count(reader, header);
+
+    if (header.is_run) {
+      // Empty cycles only add to the wait.
+      macro_wait_ms += (ts_millis_t)delta * count;
+      continue;
+    }
+
+    macro_wait_ms += delta;
+    // Capped at the rate the host accepts reports.
+    uint8_t min_interval = macro_interval_ms > replay_interval_ms ? macro_interval_ms : replay_interval_ms;
+    if (macro_wait_ms < min_interval) {
+      macro_wait_ms = min_interval;
+    }
+    macro_updates = count;
+    return true;
+  }
+
+  return false;
+}
+
+void IQueue::macro_apply_updates() {
+  MacroReader reader { macro_next };
+
+  for (; macro_updates > 0; macro_updates--) {
+    uint8_t key_state;
+    uint16_t key_code = read_update(reader, key_state);
+    macro_set_key(key_code, key_state);
+  }
+}
+
+void IQueue::macro_set_key(uint8_t key_code, uint8_t key_state) {
+  MacroKey* free_key = nullptr;
+
+  for (MacroKey& key : macro_keys) {
+    if (key.key_state != 0 && key.key_code == key_code) {
+      key.key_state = key_state;
+      return;
+    }
+    if (key.key_state == 0 && free_key == nullptr) {
+      free_key = &key;
+    }
+  }
+
+  // Releasing a key that is not held (or pressing too many) has no effect.
+  if (keyIsPressed(key_state) && free_key != nullptr) {
+    free_key->key_code = key_code;
+    free_key->key_state = key_state;
+  }
+}
+
+void IQueue::macro_events() {
+  for (MacroKey& key : macro_keys) {
+    if (key.key_state == 0) {
+      continue;
+    }
+
+    handleKeyswitchEvent(Key(key.key_code, KEY_FLAGS), MACRO_ROW, MACRO_COL, key.key_state);
+
+    if (keyToggledOn(key.key_state)) {
+      key.key_state = WAS_PRESSED | IS_PRESSED;
+    } else if (keyToggledOff(key.key_state)) {
+      key.key_state = 0;
+    }
+  }
+}
+
 EventHandlerResult IQueue::onKeyswitchEvent(kaleidoscope::Key &mappedKey, uint8_t row, uint8_t col, uint8_t keyState) {
+  if (evaluating) {
+    // A queued event, shown to the requesters of a chained session.
+    check_stop(mappedKey, row, col, keyState);
+    return EventHandlerResult::EVENT_CONSUMED;
+  }
+
   switch (state) {
     case State::IDLE:
     case State::REPLAY:
     case State::PREPARING:
+    case State::MACRO:
       return EventHandlerResult::OK;
     case State::RECORD:
+    case State::DRAIN:
       break;
     default:
       return EventHandlerResult::ERROR;
   }
 
-  should_stop |= stop_fn(mappedKey, row, col, keyState);
+  if (!scanning) {
+    // Injected by another plugin (or replayed) outside of a recorded scan.
+    return EventHandlerResult::OK;
+  }
 
-  uint8_t pos_idx = kaleidoscope::addr::addr(row, col);
+  if (state == State::RECORD) {
+    check_stop(mappedKey, row, col, keyState);
+  }
+
+  pos_idx_t pos_idx = to_pos_idx(row, col);
 
   Flag& flag = flags[pos_idx];
 
   if (flag.record_key_state == 0 && keyWasPressed(keyState)) {
     key_overrides[pos_idx] = mappedKey;
+    flag.record_held_before = keyIsPressed(keyState);
   }
 
   if (keyState != flag.record_key_state) {
@@ -174,12 +929,25 @@ EventHandlerResult IQueue::onKeyswitchEvent(kaleidoscope::Key &mappedKey, uint8_
     // (1) it toggled off.
     // (2) it previously wasn't pressed.
     if (!keyIsPressed(keyState) || !keyIsPressed(flag.record_key_state)) {
-      q_push({ .raw_pos_idx = pos_idx, .raw_key_state = keyState });
-      did_update = true;
+      if (!q_has_space(update_size(pos_idx))) {
+        // More toggles than `begin_scan` left room for. Pass it on instead of losing
+        // it, the next `begin_scan` stops recording.
+        session_metrics.overflows += 1;
+        return EventHandlerResult::OK;
+      }
+      record_update(pos_idx, keyState);
     }
 
     should_record_cycle = true;
     flag.record_key_state = keyState;
+    flag.record_held_before = flag.record_held_before && keyIsPressed(keyState);
+  }
+
+  bool live_report = state == State::DRAIN || record_mode == RecordMode::COOPERATIVE;
+  if (live_report && flag.record_held_before && flag.replay_key_state == 0) {
+    // Keys held since before the session are still part of the live report, so the host
+    // does not see them released while recording. Once replayed, replay reports them.
+    return EventHandlerResult::OK;
   }
 
   return EventHandlerResult::EVENT_CONSUMED;
@@ -188,32 +956,299 @@ EventHandlerResult IQueue::onKeyswitchEvent(kaleidoscope::Key &mappedKey, uint8_
 EventHandlerResult IQueue::start_queue(millis_offset_t timeout, IQueueShouldStop stop) {
   switch (state) {
     case State::IDLE:
-      stop_fn = stop;
-      deadline = Kaleidoscope_::millisAtCycleStart() + timeout;
+      requester_cnt = 0;
+      requesters_done = 0;
+      Deadlines::clear(DeadlineSlot::IQUEUE);
+      deferred_cnt = 0;
       state = State::PREPARING;
-      return EventHandlerResult::OK;
+      return add_requester(timeout, stop);
     case State::PREPARING:
-      // start_queue was called twice in the same cycle.
-      if (stop_fn == stop) {
-        // If it is by the same plugin, ignore the second
-        // call (we'll assume timeout was the same).
-        return EventHandlerResult::OK;
-      } else {
-        // ERROR
-        return EventHandlerResult::ERROR;
-      }
+    case State::RECORD:
+      // Join the session.
+      return add_requester(timeout, stop);
     case State::REPLAY:
-      // TODO
-      return EventHandlerResult::ERROR;
+    case State::DRAIN:
+      if (!all_requesters_done()) {
+        // Replaying a committed prefix while the session is still recording, or a
+        // chained session was already requested.
+        return add_requester(timeout, stop);
+      }
+
+      chain_pending = true;
+      requester_cnt = 0;
+      requesters_done = 0;
+      Deadlines::clear(DeadlineSlot::IQUEUE);
+      return add_requester(timeout, stop);
     default:
       return EventHandlerResult::ERROR;
   }
 }
 
+EventHandlerResult IQueue::start_queue(millis_offset_t timeout, IQueueShouldStop stop,
+                                       Key key, uint8_t row, uint8_t col, uint8_t keyState) {
+  if (state != State::IDLE && state != State::PREPARING) {
+    return EventHandlerResult::ERROR;
+  }
+
+  EventHandlerResult res = start_queue(timeout, stop);
+  if (res != EventHandlerResult::OK) {
+    return res;
+  }
+
+  return defer_event(key, row, col, keyState);
+}
+
+EventHandlerResult IQueue::defer_event(Key key, uint8_t row, uint8_t col, uint8_t keyState) {
+  if (state != State::PREPARING || deferred_cnt == MAX_DEFERRED) {
+    return EventHandlerResult::ERROR;
+  }
+
+  // Held keys already passed through before the session.
+  if (!keyToggledOn(keyState) && !keyToggledOff(keyState)) {
+    return EventHandlerResult::ERROR;
+  }
+
+  Deferred& event = deferred[deferred_cnt];
+  event.key = key;
+  event.pos_idx = to_pos_idx(row, col);
+  event.key_state = keyState;
+  deferred_cnt += 1;
+
+  check_stop(key, row, col, keyState);
+  return EventHandlerResult::OK;
+}
+
+EventHandlerResult IQueue::add_requester(millis_offset_t timeout, IQueueShouldStop stop) {
+  for (uint8_t i = 0; i < requester_cnt; i++) {
+    if (requesters[i].stop_fn == stop) {
+      // Requested twice by the same plugin, ignore the second call (we'll assume
+      // timeout was the same).
+      return EventHandlerResult::OK;
+    }
+  }
+
+  if (requester_cnt == MAX_REQUESTERS) {
+    return EventHandlerResult::ERROR;
+  }
+
+  Requester& requester = requesters[requester_cnt];
+  requester.stop_fn = stop;
+  requester.deadline = Deadlines::now() + timeout;
+  Deadlines::setEarlier(DeadlineSlot::IQUEUE, requester.deadline);
+  requester_cnt += 1;
+  return EventHandlerResult::OK;
+}
+
+void IQueue::check_stop(Key key, uint8_t row, uint8_t col, uint8_t key_state) {
+  for (uint8_t i = 0; i < requester_cnt; i++) {
+    uint8_t bit = 1 << i;
+    if (!(requesters_done & bit) && requesters[i].stop_fn(key, row, col, key_state)) {
+      requesters_done |= bit;
+    }
+  }
+}
+
+bool IQueue::check_deadlines(ts_millis_t ts) {
+  Deadlines::tick_t now = Deadlines::tick(ts);
+  if (!Deadlines::expired(DeadlineSlot::IQUEUE, now)) {
+    return all_requesters_done();
+  }
+
+  // Re-armed with the deadlines of the requesters that are still undecided.
+  Deadlines::clear(DeadlineSlot::IQUEUE);
+
+  for (uint8_t i = 0; i < requester_cnt; i++) {
+    uint8_t bit = 1 << i;
+    if (requesters_done & bit) {
+      continue;
+    }
+
+    if (Deadlines::passed(requesters[i].deadline, now)) {
+      requesters_done |= bit;
+    } else {
+      Deadlines::setEarlier(DeadlineSlot::IQUEUE, requesters[i].deadline);
+    }
+  }
+  return all_requesters_done();
+}
+
+EventHandlerResult IQueue::commit_queue() {
+  if (state != State::RECORD || evaluating || undecided_requesters() > 1) {
+    return EventHandlerResult::ERROR;
+  }
+
+  should_commit = true;
+  return EventHandlerResult::OK;
+}
+
+EventHandlerResult IQueue::rewrite_key(uint8_t row, uint8_t col, Key key) {
+  if (state != State::RECORD) {
+    return EventHandlerResult::ERROR;
+  }
+
+  pos_idx_t pos_idx = to_pos_idx(row, col);
+  key_overrides[pos_idx] = key;
+  flags[pos_idx].replay_key_rewritten = true;
+  return EventHandlerResult::OK;
+}
+
+EventHandlerResult IQueue::drop_update(uint8_t row, uint8_t col) {
+  if (state != State::RECORD) {
+    return EventHandlerResult::ERROR;
+  }
+
+  pos_idx_t pos_idx = to_pos_idx(row, col);
+  if (drop_recorded_update(pos_idx) || drop_scan_update(pos_idx)) {
+    return EventHandlerResult::OK;
+  }
+  return EventHandlerResult::ERROR;
+}
+
+EventHandlerResult IQueue::insert_update(uint8_t row, uint8_t col, uint8_t key_state) {
+  if (state != State::RECORD || !scanning || key_state == 0) {
+    return EventHandlerResult::ERROR;
+  }
+
+  pos_idx_t pos_idx = to_pos_idx(row, col);
+
+  // Synthetic updates come on top of the scanned ones, they must not take the room
+  // left for the rest of the scan.
+  if (!q_has_space(update_size(pos_idx) + HEADROOM)) {
+    return EventHandlerResult::ERROR;
+  }
+
+  record_update(pos_idx, key_state);
+  should_record_cycle = true;
+  return EventHandlerResult::OK;
+}
+
+bool IQueue::drop_recorded_update(pos_idx_t pos_idx) {
+  size_t end = recorded_end();
+  size_t idx = commit_end;
+
+  while (idx < end) {
+    size_t header_idx = idx;
+    QByte header = queue[idx++];
+
+    q_read_delta(idx, header);
+
+    size_t count_idx = idx;
+    uint8_t count = header.count == COUNT_EXT ? queue[idx++].raw : header.count + 1;
+
+    if (header.is_run) {
+      continue;
+    }
+
+    for (; count > 0; count--) {
+      size_t size = update_size(queue[idx]);
+      if (update_pos_idx(idx) != pos_idx) {
+        idx += size;
+        continue;
+      }
+
+      q_remove(idx, size);
+
+      QByte& cycle = queue[header_idx];
+      if (cycle.count == COUNT_EXT) {
+        // An explicit count of 0 is fine.
+        queue[count_idx].raw -= 1;
+      } else if (cycle.count > 0) {
+        cycle.count -= 1;
+      } else {
+        // The count field can't express 0 updates, but a run of one cycle can.
+        cycle.is_run = true;
+      }
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool IQueue::drop_scan_update(pos_idx_t pos_idx) {
+  if (!scanning) {
+    return false;
+  }
+
+  for (size_t idx = scan_updates_start; idx < queue_len;) {
+    size_t size = update_size(queue[idx]);
+    if (update_pos_idx(idx) == pos_idx) {
+      q_remove(idx, size);
+      update_cnt -= 1;
+      return true;
+    }
+    idx += size;
+  }
+
+  return false;
+}
+
+void IQueue::q_remove(size_t idx, size_t len) {
+  memmove(&queue[idx], &queue[idx + len], queue_len - idx - len);
+  queue_len -= len;
+
+  if (scanning && idx < scan_cycle_start) {
+    scan_cycle_start -= len;
+    scan_updates_start -= len;
+  }
+
+  if (last_run_idx < QUEUE_SIZE && last_run_idx > idx) {
+    last_run_idx -= len;
+  }
+
+  if (evaluating) {
+    if (idx < eval_idx) {
+      eval_idx -= len;
+    }
+    if (idx < eval_cycle_end) {
+      eval_cycle_end -= len;
+    }
+  }
+}
+
+#if CAL_IQUEUE_FOCUS
+EventHandlerResult IQueue::onFocusEvent(const char *command) {
+  if (::Focus.handleHelp(command, PSTR("iqueue.metrics"))) {
+    return EventHandlerResult::OK;
+  }
+
+  if (strcmp_P(command, PSTR("iqueue.metrics")) != 0) {
+    return EventHandlerResult::OK;
+  }
+
+  ::Focus.send(session_metrics.sessions, session_metrics.stop_endings,
+               session_metrics.deadline_endings, session_metrics.early_flushes,
+               session_metrics.overflows,
+               session_metrics.peak_queue_len, session_metrics.max_record_ms,
+               session_metrics.max_replay_us, session_metrics.cycles_recorded,
+               session_metrics.cycles_replayed);
+  return EventHandlerResult::EVENT_CONSUMED;
+}
+#endif
+
 #ifdef CAL_TEST
 void IQueue::reset() {
   queue_head = 0;
   queue_len = 0;
+  last_run_idx = QUEUE_SIZE;
+  resetMetrics();
+  scan_interval_ms = CAL_IQUEUE_SCAN_INTERVAL;
+  session_scans = 0;
+  coalesce_replay = false;
+  on_skipped_cycle = nullptr;
+  record_mode = RecordMode::BLOCKING;
+  replay_mode = ReplayMode::IMMEDIATE;
+  replay_interval_ms = CAL_IQUEUE_REPLAY_INTERVAL;
+  commit_end = 0;
+  replay_run_left = 0;
+  scanning = false;
+  requester_cnt = 0;
+  requesters_done = 0;
+  Deadlines::clear(DeadlineSlot::IQUEUE);
+  chain_pending = false;
+  evaluating = false;
+  deferred_cnt = 0;
+  macro_interval_ms = CAL_IQUEUE_REPLAY_INTERVAL;
   state = State::IDLE;
   stop_after_record = false;
 }
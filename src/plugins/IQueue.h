@@ -3,6 +3,7 @@
 #include <kaleidoscope/plugin.h>
 #include <kaleidoscope/key_defs.h>
 #include <Kaleidoscope.h>
+#include "Deadlines.h"
 
 #define try_eh(EXP) do { ::kaleidoscope::EventHandlerResult _res = EXP; if (res != ::kaleidoscope::EventHandlerResult::OK) return _res;  } while (0)
 
@@ -14,109 +15,653 @@ typedef bool (*IQueueShouldStop)(Key key, uint8_t row, uint8_t col, uint8_t keyS
 
 typedef unsigned long ts_millis_t;
 
+/// Called for each cycle skipped by a coalescing replay (with the cycle start time
+/// already set). Return true to have the cycle replayed in full after all.
+typedef bool (*IQueueOnSkippedCycle)(ts_millis_t ts);
+
 typedef uint16_t millis_offset_t;
 
+template <bool WIDE> struct IQueuePosIdx { typedef uint8_t type; };
+template <> struct IQueuePosIdx<true> { typedef uint16_t type; };
+
+/// Index of a key position (`row * COLS + col`), only 16 bits wide on boards that
+/// need it.
+typedef IQueuePosIdx<((uint32_t)ROWS * (uint32_t)COLS > 0x100)>::type pos_idx_t;
+
+/// Bytes taken by the updates of `pos_cnt` positions, one update each: Positions up to
+/// 0x3F take one byte, up to 0xEFF two, the rest three (see `IQueue::QByte`).
+constexpr uint32_t iqueue_updates_size(uint32_t pos_cnt) {
+  return pos_cnt <= 0x40 ? pos_cnt
+      : pos_cnt <= 0xF00 ? 0x40 + 2 * (pos_cnt - 0x40)
+      : 0x40 + 2 * (0xF00 - 0x40) + 3 * (pos_cnt - 0xF00);
+}
+
+/// Capacity of the IQueue, in bytes. This includes the room kept for the updates of
+/// one more scan (see `CAL_IQUEUE_SCAN_TOGGLES`).
+#ifndef CAL_IQUEUE_SIZE
+#define CAL_IQUEUE_SIZE 64
+#endif
+
+/// Most keys a single scan is expected to toggle, ten fingers by default. Recording
+/// stops early (and replays) unless that many updates still fit. Should a scan toggle
+/// even more keys while the queue is almost full, the toggles that don't fit are passed
+/// on unrecorded, ahead of the queued ones.
+#ifndef CAL_IQUEUE_SCAN_TOGGLES
+#define CAL_IQUEUE_SCAN_TOGGLES 10
+#endif
+
+/// Default minimum time (in ms) between two scans while recording.
+#ifndef CAL_IQUEUE_SCAN_INTERVAL
+#define CAL_IQUEUE_SCAN_INTERVAL 1
+#endif
+
+/// Maximum number of plugins sharing a session.
+#ifndef CAL_IQUEUE_MAX_REQUESTERS
+#define CAL_IQUEUE_MAX_REQUESTERS 4
+#endif
+
+/// Maximum number of events a session may defer before it starts recording.
+#ifndef CAL_IQUEUE_MAX_DEFERRED
+#define CAL_IQUEUE_MAX_DEFERRED 4
+#endif
+
+/// Maximum number of keys a macro holds at the same time.
+#ifndef CAL_IQUEUE_MACRO_KEYS
+#define CAL_IQUEUE_MACRO_KEYS 6
+#endif
+
+/// Set to 1 to answer the `iqueue.metrics` command of FocusSerial.
+#ifndef CAL_IQUEUE_FOCUS
+#define CAL_IQUEUE_FOCUS 0
+#endif
+
+/// Default minimum time (in ms) between two replayed cycles in paced replay mode.
+/// One full speed USB frame, so the host polls every replayed report.
+#ifndef CAL_IQUEUE_REPLAY_INTERVAL
+#define CAL_IQUEUE_REPLAY_INTERVAL 1
+#endif
+
+/// Building blocks for macros played by `IQueue::play_macro`, in the queue encoding:
+/// A cycle pressing or releasing a single key, given as HID keyboard key code. The
+/// short forms take 2 bytes, but only fit key codes up to 0x3F (letters, digits and
+/// most punctuation), which is checked at compile time. The extended forms (e.g. for
+/// modifiers) take 3 bytes.
+#define CAL_MACRO_PRESS(code) 0x00, (0x80 | ::custom::iqueue_macro_code<(code)>())
+#define CAL_MACRO_RELEASE(code) 0x00, (0x40 | ::custom::iqueue_macro_code<(code)>())
+#define CAL_MACRO_TAP(code) CAL_MACRO_PRESS(code), CAL_MACRO_RELEASE(code)
+#define CAL_MACRO_PRESS_EXT(code) 0x00, 0x20, (code)
+#define CAL_MACRO_RELEASE_EXT(code) 0x00, 0x10, (code)
+/// An empty cycle, at least `ms` (up to 30, checked at compile time) after the previous
+/// one. Longer waits take several.
+#define CAL_MACRO_WAIT(ms) (0x80 | ::custom::iqueue_macro_wait<(ms)>())
+
+/// The key code of a short macro update, which only has 6 bits for it.
+template <uint16_t code>
+constexpr uint8_t iqueue_macro_code() {
+  static_assert(code <= 0x3F, "Key code above 0x3F, use CAL_MACRO_PRESS_EXT / CAL_MACRO_RELEASE_EXT.");
+  return code;
+}
+
+/// The delta of a macro wait, which has 5 bits for it (the largest value means that
+/// more bytes follow).
+template <uint16_t ms>
+constexpr uint8_t iqueue_macro_wait() {
+  static_assert(ms <= 30, "Wait above 30 ms, split it into several CAL_MACRO_WAIT.");
+  return ms;
+}
+
 class IQueue : public Plugin {
   friend class IQueueTest;
+  friend class IQueueBench;
+  friend class ChordTest;
+  friend class ReportGateTest;
 
   public:
     EventHandlerResult beforeEachCycle();
     EventHandlerResult onKeyswitchEvent(Key &mappedKey, uint8_t row, uint8_t col, uint8_t keyState);
+    EventHandlerResult beforeReportingState();
+#if CAL_IQUEUE_FOCUS
+    EventHandlerResult onFocusEvent(const char *command);
+#endif
 
+    /// Request a session, which records until `stop` returned true, or `timeout` ms
+    /// (less than 32 s) passed.
+    ///
+    /// Several plugins may request the same session. Recording ends once all of them
+    /// are satisfied. A session requested during replay is chained: Its `stop` function
+    /// first sees the queued events that were not replayed yet, and only if they don't
+    /// satisfy it, recording continues.
     static EventHandlerResult start_queue(millis_offset_t timeout, IQueueShouldStop stop);
 
+    /// Like `start_queue`, but the triggering event is deferred: Instead of passing
+    /// through, it is recorded as the first cycle of the session (so the caller must
+    /// consume it), and shown to `stop`. Only possible before recording started.
+    static EventHandlerResult start_queue(millis_offset_t timeout, IQueueShouldStop stop,
+                                          Key key, uint8_t row, uint8_t col, uint8_t keyState);
+
+    /// Defer another toggle event of the cycle that requested the session, see above.
+    static EventHandlerResult defer_event(Key key, uint8_t row, uint8_t col, uint8_t keyState);
+
+    /// Mark everything recorded up to (and including) the current scan as decided.
+    /// It is replayed right after the scan (at the start of the next cycle in
+    /// cooperative mode), while recording continues. Only valid during recording,
+    /// i.e. from the `IQueueShouldStop` callback, and only if all other requesters
+    /// of the session are already satisfied.
+    static EventHandlerResult commit_queue();
+
+    /// The following functions rewrite the undecided part of the queue in place. Like
+    /// `commit_queue`, they are only valid during recording.
+
+    /// Replay all events of the position (from now on) with `key`, instead of the
+    /// recorded or looked up key.
+    static EventHandlerResult rewrite_key(uint8_t row, uint8_t col, Key key);
+
+    /// Drop the first undecided update of the position. A recorded cycle left without
+    /// updates is still replayed, but only repeats the previous state.
+    static EventHandlerResult drop_update(uint8_t row, uint8_t col);
+
+    /// Insert a synthetic update (e.g. a press or release) for the position into the
+    /// current scan. Only valid while a scan is being recorded, i.e. from the
+    /// `IQueueShouldStop` callback.
+    static EventHandlerResult insert_update(uint8_t row, uint8_t col, uint8_t key_state);
+
+    /// Set the minimum time between two scans while recording. The record loop waits
+    /// (without scanning) for the remainder of each interval.
+    static void setScanInterval(uint8_t interval_ms) {
+      scan_interval_ms = interval_ms;
+    }
+
+    /// Set the minimum time between two replayed cycles in paced replay mode.
+    static void setReplayInterval(uint8_t interval_ms) {
+      replay_interval_ms = interval_ms;
+    }
+
+    /// If enabled, replay skips cycles without explicit updates (whose report would be
+    /// identical to the previous one) instead of running and reporting them.
+    static void setCoalesceReplay(bool coalesce) {
+      coalesce_replay = coalesce;
+    }
+
+    /// Opt in to be notified about cycles skipped by a coalescing replay.
+    static void setOnSkippedCycle(IQueueOnSkippedCycle on_skipped) {
+      on_skipped_cycle = on_skipped;
+    }
+
+    /// Play `len` bytes of macro from flash (PROGMEM), see `CAL_MACRO_PRESS`. It is
+    /// decoded like the queue, except that update positions are key codes. Each cycle
+    /// plays as part of a normal loop iteration, at its recorded delta after the one
+    /// before, but never faster than the macro interval. Events are injected outside
+    /// the matrix (with row and col 0xFF). Only possible while no session runs, and
+    /// needs IQueue to be the first plugin.
+    static EventHandlerResult play_macro(const uint8_t* macro, uint16_t len);
+
+    /// Set the minimum time between two macro cycles. It is never shorter than the
+    /// replay interval, which should match how often the host polls for reports.
+    static void setMacroInterval(uint8_t interval_ms) {
+      macro_interval_ms = interval_ms;
+    }
+
+    /// Counters collected over all sessions, to size the queue and timeouts.
+    struct Metrics {
+      uint16_t sessions;
+      /// Sessions whose recording was ended by the stop function.
+      uint16_t stop_endings;
+      /// Sessions whose recording was ended by the deadline.
+      uint16_t deadline_endings;
+      /// Sessions which stopped recording early, because the queue was almost full.
+      uint16_t early_flushes;
+      /// Toggles passed on unrecorded, because the queue was full.
+      uint16_t overflows;
+      /// Highest number of bytes in the queue.
+      uint16_t peak_queue_len;
+      /// Longest recording of a session, in ms.
+      uint16_t max_record_ms;
+      /// Longest replay of queued cycles at once (see `ReplayMode::IMMEDIATE`), in us.
+      uint16_t max_replay_us;
+      uint32_t cycles_recorded;
+      uint32_t cycles_replayed;
+    };
+
+    static const Metrics& metrics() {
+      return session_metrics;
+    }
+
+    static void resetMetrics() {
+      memset(&session_metrics, 0, sizeof(session_metrics));
+    }
+
+    static uint16_t early_flush_count() {
+      return session_metrics.early_flushes;
+    }
+
     enum class State : uint8_t {
         IDLE = 0,
         PREPARING,
         RECORD,
         REPLAY,
+        /// Recording has ended, but recorded cycles are still being replayed paced.
+        /// Live scans are appended to the queue until it runs empty.
+        DRAIN,
+        /// Playing a macro from flash, one cycle per loop iteration.
+        MACRO,
+    };
+
+    enum class RecordMode : uint8_t {
+        /// Record the whole session from within `beforeEachCycle`, scanning the matrix
+        /// in a loop.
+        BLOCKING = 0,
+        /// Record the scan of one normal loop iteration at a time, so all other plugins
+        /// keep running during the session. Needs IQueue to be the first plugin.
+        COOPERATIVE,
+    };
+
+    static void setRecordMode(RecordMode mode) {
+      record_mode = mode;
+    }
+
+    enum class ReplayMode : uint8_t {
+        /// Replay all decided cycles at once, each with its own report.
+        IMMEDIATE = 0,
+        /// Replay at most one cycle per replay interval, as part of a normal loop
+        /// iteration, so the host polls every replayed report. Needs IQueue to be the
+        /// first plugin.
+        PACED,
     };
 
-    /// Each cycle that needs to replayed starts with a 15bit timestamp, relative to
-    /// recoding start. If the high-bit is set in the word containing the timestamp,
-    /// this cycle does not have any explicit updates and the next timestamp follows
-    /// immediately afterwards. Otherwise, a number of updates follow. These contain
-    /// mainly a 7bit index representing the key position of this update and an 8bit
-    /// representation of the key state. The remaining bit is set to mark the end of
-    /// the current cycle. A timestamp follows afterwards.
-    union QWord {
-      uint16_t raw;
+    static void setReplayMode(ReplayMode mode) {
+      replay_mode = mode;
+    }
+
+    /// The queue is a stream of bytes. Each recorded cycle starts with a header,
+    /// containing a 5bit delta timestamp (in ms, relative to the previously recorded
+    /// cycle, or recording start for the first one) and a 2bit count. If the delta
+    /// does not fit, the field is DELTA_EXT and the remainder follows as a varint
+    /// (7 bits per byte, low bits first, high bit set if more bytes follow).
+    ///
+    /// The count field stores `count - 1`, or COUNT_EXT if the actual count follows
+    /// in the next byte (after the delta bytes). If the run bit is set, the header
+    /// stands for `count` cycles without any explicit updates, each `delta` ms after
+    /// the one before. Otherwise `count` updates follow.
+    ///
+    /// An update is a single byte containing the 2bit key state and a 6bit index
+    /// representing the key position. Key states of updates are never 0, so an update
+    /// with key state 0 marks an extended update: The real key state is stored in the
+    /// next 2 bits, and the (4bit) high and (8bit, next byte) low parts of the key
+    /// position follow. If the high part is POS_IDX_HIGH_WIDE, the full 16bit position
+    /// follows in the next two bytes (high byte first) instead.
+    union QByte {
+      uint8_t raw;
       struct {
-        millis_offset_t millis_offset : 15;
-        bool no_explicit_updates : 1;
+        uint8_t delta : 5;
+        uint8_t count : 2;
+        bool is_run : 1;
       };
       struct {
-        uint8_t pos_idx : 7;
-        bool is_last_update : 1;
-        uint8_t key_state;
+        uint8_t pos_idx : 6;
+        uint8_t key_state : 2;
       };
       struct {
-        uint8_t raw_pos_idx;
-        uint8_t raw_key_state;
+        uint8_t ext_pos_idx_high : 4;
+        uint8_t ext_key_state : 2;
       };
     };
 
+    /// Recording and replay state of a key position. Both are needed at the same
+    /// time, since a committed prefix is replayed while recording continues.
     union Flag {
       uint8_t raw;
-      uint8_t record_key_state;
       struct {
-        uint8_t replay_key_state : 7;
+        uint8_t record_key_state : 2;
+        uint8_t replay_key_state : 2;
         /// The default (0) needs to be "needs key lookup".
         bool replay_no_key_override : 1;
+        /// Pressed since before recording started, and not released yet.
+        bool record_held_before : 1;
+        /// Always replay with the key override.
+        bool replay_key_rewritten : 1;
       };
     };
 
   private:
-    static constexpr size_t QUEUE_SIZE = 32;
+    static constexpr uint8_t DELTA_EXT = 0x1F;
+    static constexpr uint8_t COUNT_EXT = 0x03;
+    static constexpr uint8_t POS_IDX_SHORT_MAX = 0x3F;
+    static constexpr uint16_t POS_IDX_EXT_MAX = 0xEFF;
+    static constexpr uint8_t POS_IDX_HIGH_WIDE = 0xF;
+    static constexpr size_t MAX_UPDATE_SIZE =
+        (uint32_t)ROWS * (uint32_t)COLS - 1 > POS_IDX_EXT_MAX ? 3 : 2;
+    /// Header, up to three delta bytes and the update count.
+    static constexpr size_t MAX_HEADER_SIZE = 5;
 
-    static QWord queue[QUEUE_SIZE];
+    static constexpr uint32_t POS_CNT = (uint32_t)ROWS * (uint32_t)COLS;
+    static constexpr uint32_t SCAN_TOGGLES =
+        CAL_IQUEUE_SCAN_TOGGLES < POS_CNT ? CAL_IQUEUE_SCAN_TOGGLES : POS_CNT;
+    /// Bytes taken by the updates of the toggles of a scan, at the positions with the
+    /// largest updates.
+    static constexpr size_t SCAN_UPDATES_SIZE =
+        iqueue_updates_size(POS_CNT) - iqueue_updates_size(POS_CNT - SCAN_TOGGLES);
+    /// Space that must be left for the updates of a single scan, otherwise recording
+    /// stops early. The deferred events are recorded like a scan, so they fit as well.
+    static constexpr size_t HEADROOM =
+        SCAN_UPDATES_SIZE > CAL_IQUEUE_MAX_DEFERRED * MAX_UPDATE_SIZE
+            ? SCAN_UPDATES_SIZE
+            : CAL_IQUEUE_MAX_DEFERRED * MAX_UPDATE_SIZE;
+    static constexpr size_t QUEUE_SIZE = CAL_IQUEUE_SIZE;
+    static_assert (QUEUE_SIZE > MAX_HEADER_SIZE + HEADROOM, "CAL_IQUEUE_SIZE too small.");
+
+    static QByte queue[QUEUE_SIZE];
+    /// Read position, only advanced during replay.
     static size_t queue_head;
+    /// Write position, the queue is emptied (and both positions reset) by the replay.
     static size_t queue_len;
+    /// End of the decided part of the queue, which may be replayed.
+    static size_t commit_end;
+
+    /// Index of the last header, if it is a run that can be extended.
+    static size_t last_run_idx;
+    static millis_offset_t last_run_delta;
+
+    /// Number of updates recorded during the current scan.
+    static uint8_t update_cnt;
+
+    static constexpr size_t ACTIVE_SIZE = (ROWS * COLS + 7) / 8;
 
     static Flag flags[ROWS * COLS];
+    /// Bitset of positions with a non-zero replay key state, so replay only
+    /// visits keys that are actually held (or changed) in a cycle.
+    static uint8_t active[ACTIVE_SIZE];
     static Key key_overrides[ROWS * COLS];
 
+    struct Requester {
+      IQueueShouldStop stop_fn;
+      Deadlines::tick_t deadline;
+    };
+
+    static constexpr uint8_t MAX_REQUESTERS = CAL_IQUEUE_MAX_REQUESTERS;
+    static_assert (MAX_REQUESTERS <= 8, "CAL_IQUEUE_MAX_REQUESTERS must fit a bitset.");
+
+    struct Deferred {
+      Key key;
+      pos_idx_t pos_idx;
+      uint8_t key_state;
+    };
+
+    static constexpr uint8_t MAX_DEFERRED = CAL_IQUEUE_MAX_DEFERRED;
+
     static State state;
-    static IQueueShouldStop stop_fn;
-    static ts_millis_t deadline;
-    static bool should_stop;
-    static bool did_update;
+    static Requester requesters[MAX_REQUESTERS];
+    static uint8_t requester_cnt;
+    /// Bitset of the requesters which are satisfied.
+    static uint8_t requesters_done;
+    /// A session was requested during replay.
+    static bool chain_pending;
+    /// The requesters of a chained session see the queued events.
+    static bool evaluating;
+    static size_t eval_idx;
+    static size_t eval_cycle_end;
+    /// Events deferred while preparing the session.
+    static Deferred deferred[MAX_DEFERRED];
+    static uint8_t deferred_cnt;
+    static bool should_commit;
     static bool should_record_cycle;
+    /// A scan that should be recorded is in progress.
+    static bool scanning;
+    /// Cooperative recording ended, replay at the start of the next cycle.
+    static bool record_done;
+
+    static RecordMode record_mode;
+    static ReplayMode replay_mode;
+    /// Timestamp of the last recorded cycle.
+    static ts_millis_t last_ts;
+    static ts_millis_t scan_ts;
+    static millis_offset_t scan_delta;
+    static size_t scan_cycle_start;
+    static size_t scan_updates_start;
+
+    static uint8_t scan_interval_ms;
+    /// Number of scans performed by the current (or last) session.
+    static uint16_t session_scans;
+    /// Start time of the last replayed cycle.
+    static ts_millis_t replay_ts;
+    /// Cycles left of the run currently being replayed.
+    static uint8_t replay_run_left;
+    static millis_offset_t replay_run_delta;
+
+    static uint8_t replay_interval_ms;
+    /// Time at which the last paced cycle was replayed.
+    static ts_millis_t last_replay_ms;
+
+    static bool coalesce_replay;
+    static IQueueOnSkippedCycle on_skipped_cycle;
+
+    struct MacroKey {
+      uint8_t key_code;
+      uint8_t key_state;
+    };
+
+    static constexpr uint8_t MACRO_KEYS = CAL_IQUEUE_MACRO_KEYS;
+    /// Position of injected macro events, outside the matrix so there is no lookup.
+    static constexpr uint8_t MACRO_ROW = 0xFF;
+    static constexpr uint8_t MACRO_COL = 0xFF;
+
+    /// Next byte of the macro being played, and its end.
+    static const uint8_t* macro_next;
+    static const uint8_t* macro_end;
+    static MacroKey macro_keys[MACRO_KEYS];
+    static uint8_t macro_interval_ms;
+    /// Time at which the last macro cycle was played.
+    static ts_millis_t macro_ts;
+    /// Minimum time between the last and the next macro cycle.
+    static ts_millis_t macro_wait_ms;
+    /// Updates of the next macro cycle, 0 if its header was not read yet.
+    static uint8_t macro_updates;
+
+    /// Start of the recording of the current session.
+    static ts_millis_t record_start_ts;
+
+    static Metrics session_metrics;
+
+    static void begin_record(ts_millis_t base_ts);
+    static void record_deferred();
+    static void record_blocking();
+    /// Prepare recording a single scan, returns false if the session should end instead.
+    static bool begin_scan(ts_millis_t ts);
+    /// Finish recording a single scan, returns false if the session should end.
+    static bool end_scan(ts_millis_t ts);
+    static EventHandlerResult add_requester(millis_offset_t timeout, IQueueShouldStop stop);
+
+    static bool all_requesters_done() {
+      return requesters_done == (uint8_t)((1 << requester_cnt) - 1);
+    }
+
+    static uint8_t undecided_requesters() {
+      return requester_cnt - __builtin_popcount(requesters_done);
+    }
+
+    static void check_stop(Key key, uint8_t row, uint8_t col, uint8_t key_state);
+    /// Returns true if all requesters are satisfied afterwards.
+    static bool check_deadlines(ts_millis_t ts);
+    static bool chain_session();
+    static bool evaluate_queued();
+
+    static EventHandlerResult live_cycle();
+    static void commit();
+    static void replay_committed();
+    static EventHandlerResult finish_session();
+    static void end_record();
+    static EventHandlerResult drain();
+    static EventHandlerResult flush();
+    static void compact();
+    /// Returns false if it stopped early, for a chained session.
+    static bool replay();
+    /// Decode the next decided cycle and apply its updates, returns false if there
+    /// is none. `updates` is set to the number of explicit updates.
+    static bool next_cycle(uint8_t& updates);
+    static void apply_updates(uint8_t updates);
+    static bool replay_paced();
+    static void replay_cycle(ts_millis_t ts);
+    static void replay_events();
+    static bool skip_cycle(ts_millis_t ts);
+
+    static EventHandlerResult macro_cycle();
+    /// Read headers up to the next cycle with updates, returns false at the end.
+    static bool macro_next_cycle();
+    static void macro_apply_updates();
+    static void macro_set_key(uint8_t key_code, uint8_t key_state);
+    static void macro_events();
+
+    /// Index of the first byte after the complete cycles recorded so far.
+    static size_t recorded_end() {
+      return scanning ? scan_cycle_start : queue_len;
+    }
+
+    static bool drop_recorded_update(pos_idx_t pos_idx);
+    static bool drop_scan_update(pos_idx_t pos_idx);
+    static void q_remove(size_t idx, size_t len);
+
+    static size_t header_size(millis_offset_t delta);
+    static void record_cycle(size_t cycle_start, size_t updates_start, millis_offset_t delta);
+    /// The encoding supports any 16bit position, independent of `pos_idx_t`.
+    static void record_update(uint16_t pos_idx, uint8_t key_state);
+
+    static pos_idx_t to_pos_idx(uint8_t row, uint8_t col) {
+      return (pos_idx_t)row * COLS + col;
+    }
+
+    static uint8_t pos_row(pos_idx_t pos_idx) {
+      return pos_idx / COLS;
+    }
+
+    static uint8_t pos_col(pos_idx_t pos_idx) {
+      return pos_idx % COLS;
+    }
+
+    static void set_active(pos_idx_t pos_idx) {
+      active[pos_idx / 8] |= (uint8_t)(1 << (pos_idx % 8));
+    }
+
+    static void clear_active(pos_idx_t pos_idx) {
+      active[pos_idx / 8] &= (uint8_t)~(1 << (pos_idx % 8));
+    }
+
+    static bool q_has_space(size_t len) {
+      return queue_len + len <= QUEUE_SIZE;
+    }
+
+    /// Callers need to check `q_has_space` first.
+    static void q_push(uint8_t raw) {
+      queue[queue_len].raw = raw;
+      queue_len += 1;
+    }
 
-    static void q_push(QWord item) {
-      if (queue_len < QUEUE_SIZE) {
-        queue[(queue_head + queue_len) % QUEUE_SIZE] = item;
-        queue_len += 1;
+    /// Recording only ever commits complete cycles, so replay never reads past the end.
+    /// Popping the last run header means it can no longer be extended.
+    static QByte q_pop() {
+      if (queue_head == last_run_idx) {
+        last_run_idx = QUEUE_SIZE;
       }
+      QByte item = queue[queue_head];
+      queue_head += 1;
+      return item;
     }
 
-    static QWord q_pop() {
-      if (queue_len > 0) {
-        QWord item = queue[queue_head];
-        queue_head = (queue_head + 1) % QUEUE_SIZE;
-        queue_len -= 1;
-        return item;
+    /// Number of bytes needed for an update of the position.
+    static size_t update_size(uint16_t pos_idx) {
+      if (pos_idx <= POS_IDX_SHORT_MAX) {
+        return 1;
       }
+      return pos_idx <= POS_IDX_EXT_MAX ? 2 : 3;
+    }
+
+    /// Number of bytes used by the update starting with `update`.
+    static size_t update_size(QByte update) {
+      if (update.key_state != 0) {
+        return 1;
+      }
+      return update.ext_pos_idx_high != POS_IDX_HIGH_WIDE ? 2 : 3;
+    }
 
-      // FIXME: This is an error.
-      return { 0 };
+    static uint16_t update_pos_idx(size_t idx) {
+      QByte update = queue[idx];
+      if (update.key_state != 0) {
+        return update.pos_idx;
+      }
+      if (update.ext_pos_idx_high != POS_IDX_HIGH_WIDE) {
+        return ((uint16_t)update.ext_pos_idx_high << 8) | queue[idx + 1].raw;
+      }
+      return ((uint16_t)queue[idx + 1].raw << 8) | queue[idx + 2].raw;
     }
 
-    static QWord& q_peek(size_t idx = 0) {
-      if (idx < queue_len) {
-        return queue[(queue_head + idx) % QUEUE_SIZE];
+    /// Reads the queue encoding from the queue.
+    struct QueueReader {
+      size_t& idx;
+
+      QByte next() {
+        return queue[idx++];
       }
+    };
 
-      // FIXME: This should _really_ return an error :(
-      return queue[0];
+    /// Reads the queue encoding from a macro in flash.
+    struct MacroReader {
+      const uint8_t*& ptr;
+
+      QByte next() {
+        QByte byte;
+        byte.raw = pgm_read_byte(ptr++);
+        return byte;
+      }
+    };
+
+    template <typename Reader>
+    static millis_offset_t read_delta(Reader reader, QByte header) {
+      millis_offset_t delta = header.delta;
+      if (delta == DELTA_EXT) {
+        QByte ext;
+        uint8_t shift = 0;
+        do {
+          ext = reader.next();
+          delta += (millis_offset_t)(ext.raw & 0x7F) << shift;
+          shift += 7;
+        } while (ext.raw & 0x80);
+      }
+      return delta;
+    }
+
+    template <typename Reader>
+    static uint8_t read_count(Reader reader, QByte header) {
+      return header.count == COUNT_EXT ? reader.next().raw : header.count + 1;
+    }
+
+    /// Read a whole update, returns its position.
+    template <typename Reader>
+    static uint16_t read_update(Reader reader, uint8_t& key_state) {
+      QByte update = reader.next();
+      if (update.key_state != 0) {
+        key_state = update.key_state;
+        return update.pos_idx;
+      }
+
+      key_state = update.ext_key_state;
+      if (update.ext_pos_idx_high != POS_IDX_HIGH_WIDE) {
+        return ((uint16_t)update.ext_pos_idx_high << 8) | reader.next().raw;
+      }
+      uint16_t high = reader.next().raw;
+      return (high << 8) | reader.next().raw;
     }
 
-    static QWord& q_peek_last() {
-      // FIXME: Ugh. This works for len=0 because unsigned types underflow...
-      return q_peek(queue_len - 1);
+    static millis_offset_t q_read_delta(size_t& idx, QByte header) {
+      return read_delta(QueueReader { idx }, header);
+    }
+
+    static millis_offset_t q_pop_delta(QByte header) {
+      return q_read_delta(queue_head, header);
     }
 
 #ifdef CAL_TEST
+    static QByte q_peek(size_t idx) {
+      return queue[queue_head + idx];
+    }
+
     static bool stop_after_record;
 
     // For friendly test.
@@ -124,12 +669,12 @@ class IQueue : public Plugin {
 #endif
 };
 
-static_assert (sizeof(IQueue::QWord) == 2, "Expected IQueue::QWord to have size 2.");
+static_assert (sizeof(IQueue::QByte) == 1, "Expected IQueue::QByte to have size 1.");
 static_assert (sizeof(IQueue::Flag) == 1, "Expected IQueue::Flag to have size 1.");
 static_assert (WAS_PRESSED == 0x01, "Expected WAS_PRESSED at bit[0].");
 static_assert (IS_PRESSED == 0x02, "Expected IS_PRESSED at bit[1].");
 static_assert (IS_PRESSED == 0x02, "Expected IS_PRESSED at bit[1].");
-static_assert ((uint32_t)ROWS * (uint32_t)COLS <= 0x7F, "Too many keys.");
+static_assert ((uint32_t)ROWS * (uint32_t)COLS <= 0x10000, "Too many keys.");
 
 }
 
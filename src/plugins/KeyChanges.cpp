@@ -0,0 +1,150 @@
+#include <kaleidoscope/keyswitch_state.h>
+#include "KeyChanges.h"
+
+using namespace kaleidoscope;
+
+namespace custom {
+
+KeyChangeHandler KeyChanges::subscribers[MAX_SUBSCRIBERS] = { nullptr };
+uint8_t KeyChanges::subscriber_cnt = 0;
+
+uint8_t KeyChanges::held[POS_SIZE] = { 0 };
+uint8_t KeyChanges::known[POS_SIZE] = { 0 };
+uint8_t KeyChanges::consumed[POS_SIZE] = { 0 };
+KeyChanges::Rewrite KeyChanges::rewrites[MAX_REWRITES];
+uint8_t KeyChanges::rewrite_cnt = 0;
+
+EventHandlerResult KeyChanges::subscribe(KeyChangeHandler handler) {
+  for (uint8_t i = 0; i < subscriber_cnt; i++) {
+    if (subscribers[i] == handler) {
+      return EventHandlerResult::OK;
+    }
+  }
+
+  if (subscriber_cnt == MAX_SUBSCRIBERS) {
+    return EventHandlerResult::ERROR;
+  }
+
+  subscribers[subscriber_cnt++] = handler;
+  return EventHandlerResult::OK;
+}
+
+EventHandlerResult KeyChanges::onKeyswitchEvent(Key &mappedKey, uint8_t row, uint8_t col, uint8_t keyState) {
+  if (row >= ROWS || col >= COLS) {
+    // Injected, not a real position.
+    return deliver(mappedKey, row, col, keyState);
+  }
+
+  uint16_t p = pos(row, col);
+
+  if (keyToggledOff(keyState)) {
+    set(held, p, false);
+    forget(row, col);
+    return deliver(mappedKey, row, col, keyState);
+  }
+
+  if (!keyIsPressed(keyState)) {
+    return deliver(mappedKey, row, col, keyState);
+  }
+
+  if (keyWasPressed(keyState) && is_set(known, p)) {
+    // Still held, handled like before.
+    if (is_set(consumed, p)) {
+      return EventHandlerResult::EVENT_CONSUMED;
+    }
+
+    int8_t idx = find_rewrite(p);
+    if (idx >= 0) {
+      mappedKey = rewrites[idx].key;
+    }
+    return EventHandlerResult::OK;
+  }
+
+  // Pressed, or held but not known (e.g. after `forget`).
+  Key original = mappedKey;
+  EventHandlerResult result = deliver(mappedKey, row, col, keyState);
+  set(held, p, true);
+  remember(p, original, mappedKey, result);
+  return result;
+}
+
+void KeyChanges::addPassedOn(uint8_t* bits) {
+  for (size_t byte_idx = 0; byte_idx < POS_SIZE; byte_idx++) {
+    bits[byte_idx] |= held[byte_idx] & known[byte_idx] & ~consumed[byte_idx];
+  }
+}
+
+void KeyChanges::forget(uint8_t row, uint8_t col) {
+  uint16_t p = pos(row, col);
+  set(known, p, false);
+  set(consumed, p, false);
+  drop_rewrite(p);
+}
+
+EventHandlerResult KeyChanges::deliver(Key &mappedKey, uint8_t row, uint8_t col, uint8_t keyState) {
+  for (uint8_t i = 0; i < subscriber_cnt; i++) {
+    EventHandlerResult result = subscribers[i](mappedKey, row, col, keyState);
+    if (result != EventHandlerResult::OK) {
+      return result;
+    }
+  }
+  return EventHandlerResult::OK;
+}
+
+void KeyChanges::remember(uint16_t p, Key original, Key mappedKey, EventHandlerResult result) {
+  // A subscriber may have called `forget` while handling the event.
+  drop_rewrite(p);
+
+  switch (result) {
+    case EventHandlerResult::OK:
+      if (mappedKey.raw != original.raw) {
+        if (rewrite_cnt == MAX_REWRITES) {
+          // Out of space, keep delivering this key's events.
+          set(known, p, false);
+          return;
+        }
+        rewrites[rewrite_cnt++] = Rewrite { p, mappedKey };
+      }
+      set(consumed, p, false);
+      break;
+    case EventHandlerResult::EVENT_CONSUMED:
+      set(consumed, p, true);
+      break;
+    default:
+      // Let the subscribers see the next event again.
+      set(known, p, false);
+      return;
+  }
+
+  set(known, p, true);
+}
+
+int8_t KeyChanges::find_rewrite(uint16_t p) {
+  for (uint8_t i = 0; i < rewrite_cnt; i++) {
+    if (rewrites[i].pos == p) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void KeyChanges::drop_rewrite(uint16_t p) {
+  int8_t idx = find_rewrite(p);
+  if (idx >= 0) {
+    rewrites[idx] = rewrites[--rewrite_cnt];
+  }
+}
+
+#ifdef CAL_TEST
+void KeyChanges::reset() {
+  subscriber_cnt = 0;
+  memset(held, 0, sizeof(held));
+  memset(known, 0, sizeof(known));
+  memset(consumed, 0, sizeof(consumed));
+  rewrite_cnt = 0;
+}
+#endif
+
+}
+
+custom::KeyChanges KeyChanges;
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <kaleidoscope/plugin.h>
+#include <kaleidoscope/key_defs.h>
+#include <Kaleidoscope.h>
+
+/// Maximum number of plugins subscribed to `KeyChanges`.
+#ifndef CAL_KEY_CHANGES_MAX_SUBSCRIBERS
+#define CAL_KEY_CHANGES_MAX_SUBSCRIBERS 4
+#endif
+
+/// Maximum number of held keys whose key was rewritten by a subscriber. Further ones are
+/// delivered to the subscribers on every scan, as without `KeyChanges`.
+#ifndef CAL_KEY_CHANGES_REWRITES
+#define CAL_KEY_CHANGES_REWRITES 8
+#endif
+
+namespace custom {
+
+using namespace kaleidoscope;
+
+typedef EventHandlerResult (*KeyChangeHandler)(Key &mappedKey, uint8_t row, uint8_t col, uint8_t keyState);
+
+/// Opt-in delivery of key events to plugins which only care about changes: Subscribers
+/// see toggle on and toggle off events, but not the events of keys that are still held.
+/// Those get the same treatment the subscribers gave the press (passed through,
+/// rewritten to another key, or consumed), without calling them, until the key is
+/// released or a subscriber calls `forget`.
+///
+/// Must be registered where the subscribed plugins would see key events.
+class KeyChanges : public Plugin {
+  friend class KeyChangesTest;
+  friend class KeyChangesTapModTest;
+
+  public:
+    /// Deliver changes to `handler`, after those subscribed earlier. Fails if there are
+    /// more than `CAL_KEY_CHANGES_MAX_SUBSCRIBERS`.
+    static EventHandlerResult subscribe(KeyChangeHandler handler);
+
+    EventHandlerResult onKeyswitchEvent(Key &mappedKey, uint8_t row, uint8_t col, uint8_t keyState);
+
+    /// Whether the key at `row` / `col` is held, i.e. it was pressed and not released.
+    static bool isHeld(uint8_t row, uint8_t col) {
+      return is_set(held, pos(row, col));
+    }
+
+    /// Add the positions of the held keys whose events are passed on (possibly rewritten)
+    /// without calling the subscribers to the bitset `bits`. Along with the events the
+    /// subscribers see and pass on, these are the keys in the report.
+    static void addPassedOn(uint8_t* bits);
+
+    /// Deliver the next event of the key at `row` / `col` to the subscribers again, e.g.
+    /// because they would treat it differently now.
+    static void forget(uint8_t row, uint8_t col);
+
+  private:
+    static constexpr uint8_t MAX_SUBSCRIBERS = CAL_KEY_CHANGES_MAX_SUBSCRIBERS;
+    static constexpr uint8_t MAX_REWRITES = CAL_KEY_CHANGES_REWRITES;
+    static constexpr size_t POS_SIZE = (ROWS * COLS + 7) / 8;
+
+    struct Rewrite {
+      uint16_t pos;
+      Key key;
+    };
+
+    static KeyChangeHandler subscribers[MAX_SUBSCRIBERS];
+    static uint8_t subscriber_cnt;
+
+    /// Bitset of held positions.
+    static uint8_t held[POS_SIZE];
+    /// Bitset of held positions whose events are handled without the subscribers.
+    static uint8_t known[POS_SIZE];
+    /// Bitset of known positions whose events are consumed.
+    static uint8_t consumed[POS_SIZE];
+    /// Known positions whose key is rewritten.
+    static Rewrite rewrites[MAX_REWRITES];
+    static uint8_t rewrite_cnt;
+
+    static uint16_t pos(uint8_t row, uint8_t col) {
+      return (uint16_t)row * COLS + col;
+    }
+
+    static bool is_set(const uint8_t* bits, uint16_t pos) {
+      return (bits[pos / 8] >> (pos % 8)) & 1;
+    }
+
+    static void set(uint8_t* bits, uint16_t pos, bool value) {
+      if (value) {
+        bits[pos / 8] |= 1 << (pos % 8);
+      } else {
+        bits[pos / 8] &= ~(1 << (pos % 8));
+      }
+    }
+
+    static EventHandlerResult deliver(Key &mappedKey, uint8_t row, uint8_t col, uint8_t keyState);
+    /// Remember how the subscribers treated the press (or first seen hold) of `pos`.
+    static void remember(uint16_t pos, Key original, Key mappedKey, EventHandlerResult result);
+    static int8_t find_rewrite(uint16_t pos);
+    static void drop_rewrite(uint16_t pos);
+
+#ifdef CAL_TEST
+    static void reset();
+#endif
+};
+
+}
+
+extern custom::KeyChanges KeyChanges;
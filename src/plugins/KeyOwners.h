@@ -0,0 +1,140 @@
+#pragma once
+
+#include <Kaleidoscope.h>
+#include "TapMod.h"
+
+/// Set to 1 when the sketch defines its keymap with `KEYMAPS_WITH_OWNERS`, so plugins
+/// can skip positions that never map to one of their keys.
+#ifndef CAL_KEY_OWNERS
+#define CAL_KEY_OWNERS 0
+#endif
+
+namespace custom {
+
+/// Plugins with keys of their own.
+enum class KeyOwner : uint8_t {
+  TAPMOD = 0,
+  COUNT,
+};
+
+namespace key_owners {
+
+/// Stand-in for `Key` while building the map: Key macros expanded in this namespace
+/// construct it instead. Unlike the `Key` union, it can be inspected in constant
+/// expressions, because all of its members are always set.
+struct Key {
+  uint8_t keyCode;
+  uint8_t flags;
+  uint16_t raw;
+
+  constexpr Key(uint8_t keyCode_, uint8_t flags_)
+    : keyCode(keyCode_), flags(flags_), raw((uint16_t)(flags_ << 8 | keyCode_)) {}
+  constexpr Key(uint16_t raw_)
+    : keyCode((uint8_t)raw_), flags((uint8_t)(raw_ >> 8)), raw(raw_) {}
+};
+
+/// Whether `owner` handles `key`. Add a case for each plugin with keys of its own.
+constexpr bool owns(KeyOwner owner, Key key) {
+  return owner == KeyOwner::TAPMOD
+         ? Key_TapMod(0).raw <= key.raw && key.raw <= Key_TapMod(CAL_TAPMOD_ENTRIES - 1).raw
+         : false;
+}
+
+}
+
+/// Per plugin bitsets of the positions that map to one of its keys on any layer, built
+/// from the keymap at compile time by `KEYMAPS_WITH_OWNERS`. Plugins test their bit
+/// before looking at the key, see `mayOwn`.
+///
+/// Only valid while no plugin before the owner changes keys to ones of the owner.
+class KeyOwners {
+  public:
+    static constexpr uint8_t OWNER_CNT = (uint8_t)KeyOwner::COUNT;
+    static constexpr uint16_t POS_CNT = ROWS * COLS;
+    static constexpr uint8_t POS_SIZE = (POS_CNT + 7) / 8;
+
+    struct Map {
+      uint8_t bits[OWNER_CNT * POS_SIZE];
+    };
+
+    /// Whether `owner` may own the key at `row`, `col`: False only if no layer maps the
+    /// position to one of its keys. Always true without a map, and for positions
+    /// outside the matrix (such as injected keys).
+    static bool mayOwn(KeyOwner owner, uint8_t row, uint8_t col);
+
+    /// Whether `owner` owns a key at position `pos` in `map` (which is in PROGMEM).
+    static bool owned(const Map& map, KeyOwner owner, uint16_t pos) {
+      return (pgm_read_byte(&map.bits[(uint8_t)owner * POS_SIZE + pos / 8]) >> (pos % 8)) & 1;
+    }
+
+    template <uint16_t... I>
+    struct Indices {};
+
+    template <uint16_t N, uint16_t... I>
+    struct MakeIndices : MakeIndices<N - 1, N - 1, I...> {};
+
+    template <uint16_t... I>
+    struct MakeIndices<0, I...> {
+      typedef Indices<I...> type;
+    };
+
+    /// The map of `keymap`, one bitset byte per index.
+    template <size_t L, uint16_t... I>
+    static constexpr Map build(const key_owners::Key (&keymap)[L][ROWS][COLS], Indices<I...>) {
+      return Map { { pos_byte(keymap, (KeyOwner)(I / POS_SIZE), I % POS_SIZE * 8)... } };
+    }
+
+  private:
+    /// Bits of the eight positions from `pos`.
+    template <size_t L>
+    static constexpr uint8_t pos_byte(const key_owners::Key (&keymap)[L][ROWS][COLS], KeyOwner owner,
+                                      uint16_t pos, uint8_t shift = 0) {
+      return shift == 8 || pos + shift >= POS_CNT
+             ? 0
+             : (uint8_t)(any_layer(keymap, owner, pos + shift) << shift
+                         | pos_byte(keymap, owner, pos, shift + 1));
+    }
+
+    template <size_t L>
+    static constexpr bool any_layer(const key_owners::Key (&keymap)[L][ROWS][COLS], KeyOwner owner,
+                                    uint16_t pos, size_t layer = 0) {
+      return layer < L
+             && (key_owners::owns(owner, keymap[layer][pos / COLS][pos % COLS])
+                 || any_layer(keymap, owner, pos, layer + 1));
+    }
+};
+
+namespace key_owners {
+
+/// Defined by `KEYMAPS_WITH_OWNERS`.
+extern const KeyOwners::Map map PROGMEM;
+
+}
+
+inline bool KeyOwners::mayOwn(KeyOwner owner, uint8_t row, uint8_t col) {
+#if CAL_KEY_OWNERS
+  if (row >= ROWS || col >= COLS) {
+    return true;
+  }
+  return owned(key_owners::map, owner, (uint16_t)row * COLS + col);
+#else
+  (void)owner;
+  (void)row;
+  (void)col;
+  return true;
+#endif
+}
+
+}
+
+/// Like `KEYMAPS`, and also builds the `KeyOwners` map of the layers.
+#define KEYMAPS_WITH_OWNERS(layers...)                                            \
+  KEYMAPS(layers)                                                                 \
+  namespace custom {                                                              \
+  namespace key_owners {                                                          \
+  constexpr Key keymap[][ROWS][COLS] = { layers };                                \
+  constexpr KeyOwners::Map built_map = KeyOwners::build(                          \
+    keymap, KeyOwners::MakeIndices<KeyOwners::OWNER_CNT * KeyOwners::POS_SIZE>::type()); \
+  const KeyOwners::Map map PROGMEM = built_map;                                   \
+  }                                                                               \
+  }
@@ -0,0 +1,139 @@
+#include <kaleidoscope/keyswitch_state.h>
+#include <kaleidoscope/hid.h>
+#include "ReportGate.h"
+
+using namespace kaleidoscope;
+
+namespace custom {
+
+uint8_t ReportGate::min_interval_ms = CAL_REPORT_GATE_INTERVAL;
+bool ReportGate::active = false;
+
+ReportGate::Report ReportGate::pending = { 0 };
+ReportGate::Report ReportGate::last = { 0 };
+
+ReportGate::Metrics ReportGate::gate_metrics = { 0 };
+
+void ReportGate::send() {
+  hid::sendKeyboardReport();
+
+  if (!active) {
+    return;
+  }
+
+  if (same(pending, last)) {
+    // Not sent again by KeyboardioHID, so the interval doesn't restart.
+    gate_metrics.suppressed += 1;
+    return;
+  }
+
+  last = pending;
+  sent_other();
+}
+
+bool ReportGate::ready() {
+  if (!Deadlines::armed(DeadlineSlot::REPORT_GATE)) {
+    return true;
+  }
+  if (!Deadlines::expired(DeadlineSlot::REPORT_GATE, Deadlines::tick(millis()))) {
+    return false;
+  }
+  Deadlines::clear(DeadlineSlot::REPORT_GATE);
+  return true;
+}
+
+void ReportGate::releaseAllKeys() {
+  hid::releaseAllKeys();
+  clear(pending);
+}
+
+EventHandlerResult ReportGate::onKeyswitchEvent(Key &mappedKey, uint8_t row, uint8_t col, uint8_t keyState) {
+  if (!keyIsPressed(keyState)) {
+    return EventHandlerResult::OK;
+  }
+
+  // The position is part of the key, so different keys are never mistaken for the same
+  // one, even if the event's key wasn't looked up yet.
+  KeyAt key = { row, col, mappedKey };
+  if (pending.untracked || contains(pending, key)) {
+    return EventHandlerResult::OK;
+  }
+
+  if (pending.key_cnt == MAX_KEYS) {
+    pending.untracked = true;
+    gate_metrics.untracked += 1;
+    return EventHandlerResult::OK;
+  }
+
+  pending.keys[pending.key_cnt++] = key;
+  return EventHandlerResult::OK;
+}
+
+EventHandlerResult ReportGate::afterEachCycle() {
+  // The report of the cycle was sent (by Kaleidoscope's loop, or by IQueue's replay),
+  // then cleared.
+  if (!active || !same(pending, last)) {
+    last = pending;
+    sent_other();
+  }
+
+  active = true;
+  clear(pending);
+  return EventHandlerResult::OK;
+}
+
+bool ReportGate::same(const Report& a, const Report& b) {
+  if (a.untracked || b.untracked || a.key_cnt != b.key_cnt) {
+    return false;
+  }
+
+  for (uint8_t i = 0; i < a.key_cnt; i++) {
+    if (!contains(b, a.keys[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ReportGate::contains(const Report& report, const KeyAt& key) {
+  for (uint8_t i = 0; i < report.key_cnt; i++) {
+    const KeyAt& other = report.keys[i];
+    if (other.row == key.row && other.col == key.col && other.key == key.key) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void ReportGate::sent_other() {
+  if (!ready()) {
+    gate_metrics.early += 1;
+  }
+  gate_metrics.sent += 1;
+
+  Deadlines::clear(DeadlineSlot::REPORT_GATE);
+  if (min_interval_ms > 0) {
+    // Passed (and ready) once `min_interval_ms` elapsed.
+    Deadlines::setEarlier(DeadlineSlot::REPORT_GATE, Deadlines::tick(millis()) + min_interval_ms - 1);
+  }
+}
+
+void ReportGate::clear(Report& report) {
+  report.key_cnt = 0;
+  report.untracked = false;
+}
+
+#ifdef CAL_TEST
+void ReportGate::reset() {
+  min_interval_ms = CAL_REPORT_GATE_INTERVAL;
+  active = false;
+  clear(pending);
+  clear(last);
+  Deadlines::clear(DeadlineSlot::REPORT_GATE);
+  resetMetrics();
+}
+#endif
+
+}
+
+custom::ReportGate ReportGate;
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <kaleidoscope/plugin.h>
+#include <kaleidoscope/key_defs.h>
+#include <Kaleidoscope.h>
+#include "Deadlines.h"
+
+/// Maximum number of pressed keys tracked per report. Reports with more keys are never
+/// suppressed.
+#ifndef CAL_REPORT_GATE_KEYS
+#define CAL_REPORT_GATE_KEYS 12
+#endif
+
+/// Default minimum time (in ms) between two reports with different keys, 0 to send
+/// them right away.
+#ifndef CAL_REPORT_GATE_INTERVAL
+#define CAL_REPORT_GATE_INTERVAL 0
+#endif
+
+namespace custom {
+
+using namespace kaleidoscope;
+
+/// Keeps the keys of the last keyboard report sent, to space reports with other keys by
+/// a minimum interval (e.g. the host's polling interval, so it sees every state), and
+/// to count the reports that change nothing (KeyboardioHID doesn't send those).
+///
+/// Only plugins sending several reports at once through `send` are spaced: They check
+/// `ready` first, and hold the rest for a later cycle (TapMod's queue flush, and IQueue
+/// in its paced replay mode). Kaleidoscope's loop report and IQueue's immediate replay
+/// are sent right away, and only counted in `early`. Holding the loop report could lose
+/// a key pressed and released in the meantime, and the immediate replay has no later
+/// cycle to continue in. A host polling at the interval may miss those reports, use
+/// IQueue's paced replay if it must see every replayed one.
+///
+/// Must be registered after all plugins that change or consume key events, since it
+/// builds its copy of each report from the events it sees. Plugins must not add keys to
+/// reports directly. Until the plugin ran once, `send` sends every report.
+class ReportGate : public Plugin {
+  friend class ReportGateTest;
+  friend class TapModReportGateTest;
+
+  public:
+    struct Metrics {
+      /// Reports sent with keys different from the last one.
+      uint32_t sent;
+      /// Reports sent through `send` with the same keys as the last one, which
+      /// KeyboardioHID skips.
+      uint32_t suppressed;
+      /// Reports with other keys sent before the minimum interval passed.
+      uint16_t early;
+      /// Reports with more than `CAL_REPORT_GATE_KEYS` keys.
+      uint16_t untracked;
+    };
+
+    static const Metrics& metrics() {
+      return gate_metrics;
+    }
+
+    static void resetMetrics() {
+      memset(&gate_metrics, 0, sizeof(gate_metrics));
+    }
+
+    /// Set the minimum time between two reports with different keys (0 to disable).
+    static void setMinInterval(uint8_t interval_ms) {
+      min_interval_ms = interval_ms;
+    }
+
+    /// Send the keyboard report now. Use this instead of `hid::sendKeyboardReport()`
+    /// when sending mid-cycle, so the report is accounted for.
+    static void send();
+
+    /// Whether the minimum interval passed since the last report with other keys, so
+    /// the next one may be sent.
+    static bool ready();
+
+    /// Clear the keyboard report and the copy of its keys, to rebuild it mid-cycle. Use
+    /// this instead of `hid::releaseAllKeys()` after `send`.
+    static void releaseAllKeys();
+
+    EventHandlerResult onKeyswitchEvent(Key &mappedKey, uint8_t row, uint8_t col, uint8_t keyState);
+    EventHandlerResult afterEachCycle();
+
+  private:
+    static constexpr uint8_t MAX_KEYS = CAL_REPORT_GATE_KEYS;
+
+    struct KeyAt {
+      uint8_t row;
+      uint8_t col;
+      Key key;
+    };
+
+    struct Report {
+      KeyAt keys[MAX_KEYS];
+      uint8_t key_cnt;
+      /// More keys than fit, so it can't be compared.
+      bool untracked;
+    };
+
+    static uint8_t min_interval_ms;
+    /// Whether the plugin is registered, i.e. `pending` is kept up to date.
+    static bool active;
+
+    /// Keys added to the report since it was last cleared.
+    static Report pending;
+    /// Keys of the last report sent.
+    static Report last;
+
+    static Metrics gate_metrics;
+
+    static bool same(const Report& a, const Report& b);
+    static bool contains(const Report& report, const KeyAt& key);
+    /// Account for a report with other keys, and arm the interval until the next one.
+    static void sent_other();
+    static void clear(Report& report);
+
+#ifdef CAL_TEST
+    static void reset();
+#endif
+};
+
+}
+
+extern custom::ReportGate ReportGate;
@@ -0,0 +1,68 @@
+#include <kaleidoscope/keyswitch_state.h>
+#include "ScanGovernor.h"
+
+using namespace kaleidoscope;
+
+namespace custom {
+
+uint16_t ScanGovernor::idle_ms = CAL_SCAN_IDLE_MS;
+uint16_t ScanGovernor::slow_ms = CAL_SCAN_SLOW_MS;
+
+ScanGovernor::Rate ScanGovernor::current = ScanGovernor::Rate::FULL;
+Deadlines::tick_t ScanGovernor::since = 0;
+
+bool ScanGovernor::shouldScan() {
+  Deadlines::tick_t now = Deadlines::tick(millis());
+  Deadlines::tick_t elapsed = now - since;
+
+  switch (current) {
+    case Rate::FULL:
+      if (elapsed >= idle_ms) {
+        // Idle, this is the first slow scan.
+        set_rate(Rate::SLOW, now);
+      }
+      return true;
+    case Rate::SLOW:
+      if (elapsed < slow_ms) {
+        return false;
+      }
+      since = now;
+      return true;
+    default:
+      return true;
+  }
+}
+
+void ScanGovernor::hostSuspended() {
+  set_rate(Rate::SLOW, Deadlines::tick(millis()));
+}
+
+void ScanGovernor::hostResumed() {
+  set_rate(Rate::FULL, Deadlines::tick(millis()));
+}
+
+EventHandlerResult ScanGovernor::onKeyswitchEvent(Key &/*mappedKey*/, uint8_t /*row*/, uint8_t /*col*/, uint8_t keyState) {
+  // Only presses and releases, held keys are reported every scan.
+  if (!keyIsInjected(keyState) && (keyToggledOn(keyState) || keyToggledOff(keyState))) {
+    set_rate(Rate::FULL, Deadlines::now());
+  }
+  return EventHandlerResult::OK;
+}
+
+void ScanGovernor::set_rate(Rate rate, Deadlines::tick_t now) {
+  current = rate;
+  since = now;
+}
+
+#ifdef CAL_TEST
+void ScanGovernor::reset() {
+  idle_ms = CAL_SCAN_IDLE_MS;
+  slow_ms = CAL_SCAN_SLOW_MS;
+  current = Rate::FULL;
+  since = Deadlines::tick(millis());
+}
+#endif
+
+}
+
+custom::ScanGovernor ScanGovernor;
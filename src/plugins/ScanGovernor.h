@@ -0,0 +1,82 @@
+#pragma once
+
+#include <kaleidoscope/plugin.h>
+#include <kaleidoscope/key_defs.h>
+#include <Kaleidoscope.h>
+#include "Deadlines.h"
+
+/// Default time (in ms) without a key press or release after which scanning slows down.
+#ifndef CAL_SCAN_IDLE_MS
+#define CAL_SCAN_IDLE_MS 5000
+#endif
+
+/// Default time (in ms) between scans while slowed down. This bounds how much later the
+/// first key after an idle period is seen.
+#ifndef CAL_SCAN_SLOW_MS
+#define CAL_SCAN_SLOW_MS 16
+#endif
+
+namespace custom {
+
+using namespace kaleidoscope;
+
+/// Lowers the scan rate while nothing happens: After `CAL_SCAN_IDLE_MS` without a key
+/// press or release, or as soon as the host suspends, the matrix is only scanned every
+/// `CAL_SCAN_SLOW_MS`. The first press or release seen by a slow scan, or the host
+/// resuming, restores the full rate. Held keys don't count as activity, so the release
+/// of a key held longer than the idle timeout is seen up to one slow period late.
+///
+/// The sketch's `loop()` must only call `Kaleidoscope.loop()` when `shouldScan()`, the
+/// HostPowerManagement event handler must forward suspend and resume, and the plugin
+/// must be registered before any plugin that consumes key events. The idle timeout
+/// should exceed the timeouts of other plugins, which are handled late by up to one
+/// slow period otherwise.
+class ScanGovernor : public Plugin {
+  friend class ScanGovernorTest;
+
+  public:
+    enum class Rate : uint8_t {
+      FULL = 0,
+      SLOW,
+    };
+
+    /// Set how long to wait without key activity before slowing down (at most 32 s).
+    static void setIdleTimeout(uint16_t ms) {
+      idle_ms = ms;
+    }
+
+    /// Set the time between scans while slowed down.
+    static void setSlowPeriod(uint16_t ms) {
+      slow_ms = ms;
+    }
+
+    static Rate rate() {
+      return current;
+    }
+
+    /// Whether to run a cycle (and scan the matrix) now. Must be called by `loop()`.
+    static bool shouldScan();
+
+    static void hostSuspended();
+    static void hostResumed();
+
+    EventHandlerResult onKeyswitchEvent(Key &mappedKey, uint8_t row, uint8_t col, uint8_t keyState);
+
+  private:
+    static uint16_t idle_ms;
+    static uint16_t slow_ms;
+
+    static Rate current;
+    /// Full rate: When the last key event was seen. Slow rate: When the last scan ran.
+    static Deadlines::tick_t since;
+
+    static void set_rate(Rate rate, Deadlines::tick_t now);
+
+#ifdef CAL_TEST
+    static void reset();
+#endif
+};
+
+}
+
+extern custom::ScanGovernor ScanGovernor;
@@ -1,147 +1,229 @@
 #include <kaleidoscope/keyswitch_state.h>
 #include <kaleidoscope/addr.h>
-#include <kaleidoscope/hid.h>
 #include "TapMod.h"
+#include "KeyOwners.h"
+#include "ReportGate.h"
+
+#if CAL_TAPMOD_EEPROM
+#include <Kaleidoscope-EEPROM-Settings.h>
+#endif
 
 using namespace kaleidoscope;
 
 namespace custom {
 
 TapMod::Entry TapMod::entries[ENTRY_CNT] = { 0 };
-TapMod::QueueItem TapMod::queue[QUEUE_MAX] = { 0 };
-size_t TapMod::queue_len = 0;
-size_t TapMod::queue_head = 0;
+uint8_t TapMod::active[ACTIVE_SIZE] = { 0 };
 bool TapMod::real_key_down_this_cycle = false;
 bool TapMod::listening = false;
-bool TapMod::waiting = false;
 bool TapMod::injecting = false;
 uint8_t TapMod::queuing = 0;
 
+constexpr TapMod::Transition TapMod::TRANSITIONS[STATE_CNT][EVENT_CNT] PROGMEM;
+constexpr TapMod::Timer TapMod::TIMERS[STATE_CNT] PROGMEM;
+TapMod::QueueItem TapMod::queue[QUEUE_MAX] = { 0 };
+size_t TapMod::queue_len = 0;
+uint8_t TapMod::queue_pressed[POS_SIZE] = { 0 };
+bool TapMod::overflowed = false;
+uint8_t TapMod::overflow_toggled[POS_SIZE] = { 0 };
+uint8_t TapMod::overflow_pressed[POS_SIZE] = { 0 };
+bool TapMod::replaying = false;
+uint8_t TapMod::report_held[POS_SIZE] = { 0 };
+bool TapMod::rebuilding = false;
+
+uint8_t TapMod::last_down_row = 0;
+uint8_t TapMod::last_down_col = 0;
+bool TapMod::permissive_hold = false;
+bool TapMod::via_key_changes = false;
+bool TapMod::adaptive = false;
+TapMod::Bounds TapMod::tap_bounds = { CAL_TAPMOD_TAP_MIN_MS, CAL_TAPMOD_TAP_MAX_MS };
+TapMod::Bounds TapMod::active_bounds = { CAL_TAPMOD_ACTIVE_MIN_MS, CAL_TAPMOD_ACTIVE_MAX_MS };
+TapMod::Timing TapMod::timings[ENTRY_CNT] = { 0 };
+TapMod::Saved TapMod::saved[ENTRY_CNT] = { 0 };
+#if CAL_TAPMOD_EEPROM
+uint16_t TapMod::eeprom_base = 0;
+#endif
+
 void TapMod::setActual(size_t idx, Key actual) {
   if (idx < ENTRY_CNT) {
     entries[idx].actual_key = actual;
   }
 }
 
+EventHandlerResult TapMod::setTiming(size_t idx, const Timing& timing) {
+  if (idx >= ENTRY_CNT
+      || timing.tap_avg8 > (MAX_SAMPLE_MS << 3) || timing.active_avg8 > (MAX_SAMPLE_MS << 3)) {
+    return EventHandlerResult::ERROR;
+  }
+
+  timings[idx] = timing;
+  saved[idx] = Saved { tapTime(idx), activeTime(idx) };
+  return EventHandlerResult::OK;
+}
+
+uint16_t TapMod::tapTime(size_t idx) {
+  if (!adaptive) {
+    return TAP_TIME_MS;
+  }
+
+  const Timing& timing = timings[idx];
+  return window(timing.tap_avg8, timing.tap_dev4, TAP_TIME_MS, tap_bounds);
+}
+
+uint16_t TapMod::activeTime(size_t idx) {
+  if (!adaptive) {
+    return ACTIVE_TIME_MAX_MS;
+  }
+
+  const Timing& timing = timings[idx];
+  uint16_t active_ms = window(timing.active_avg8, timing.active_dev4, ACTIVE_TIME_MAX_MS, active_bounds);
+  // Measured since the press, so a tap must not expire before it could be one.
+  uint16_t tap_ms = tapTime(idx);
+  return active_ms < tap_ms ? tap_ms : active_ms;
+}
+
+#if CAL_TAPMOD_EEPROM
+EventHandlerResult TapMod::onSetup() {
+  eeprom_base = ::EEPROMSettings.requestSlice(sizeof(timings));
+
+  for (size_t idx = 0; idx < ENTRY_CNT; idx++) {
+    Timing timing;
+    EEPROM.get(eeprom_base + idx * sizeof(Timing), timing);
+    // Erased or invalid slots keep the defaults.
+    setTiming(idx, timing);
+  }
+
+  return EventHandlerResult::OK;
+}
+#endif
+
 EventHandlerResult TapMod::beforeEachCycle() {
   real_key_down_this_cycle = false;
+  memset(report_held, 0, sizeof(report_held));
 
-  if (!waiting) {
+  Deadlines::tick_t now = Deadlines::now();
+  if (!Deadlines::expired(DeadlineSlot::TAPMOD, now)) {
     return EventHandlerResult::OK;
   }
 
-  waiting = false;
+  // Re-armed with the deadlines that didn't expire yet.
+  Deadlines::clear(DeadlineSlot::TAPMOD);
 
-  ts_millis_t ms = Kaleidoscope_::millisAtCycleStart();
+  for (size_t byte_idx = 0; byte_idx < ACTIVE_SIZE; byte_idx++) {
+    uint8_t bits = active[byte_idx];
 
-  for (size_t entry_idx = 0; entry_idx < ENTRY_CNT; entry_idx++) {
-    Entry& entry = entries[entry_idx];
+    while (bits != 0) {
+      size_t entry_idx = byte_idx * 8 + __builtin_ctz(bits);
+      bits &= bits - 1;
 
-    switch (entry.state) {
-      case State::PRESSED_IDLE:
-      case State::PRESSED_PRE_QUEUE:
-        if (ms - entry.pressed_ts <= TAP_TIME_MS) {
-          waiting = true;
-        } else {
-          entry.state = State::PRESSED_REAL;
-        }
-        break;
-      case State::PRESSED_DELAYED:
-        if (ms - entry.pressed_ts <= ACTIVE_TIME_MAX_MS) {
-          waiting = true;
-        } else {
-          entry.state = State::RELEASE_THIS_CYCLE;
-        }
-      default:
-        break;
+      if (timer(entries[entry_idx].state) == Timer::NONE) {
+        continue;
+      }
+
+      Deadlines::tick_t entry_deadline = deadline(entry_idx);
+      if (Deadlines::passed(entry_deadline, now)) {
+        dispatch(entry_idx, Event::TIMEOUT);
+      } else {
+        Deadlines::setEarlier(DeadlineSlot::TAPMOD, entry_deadline);
+      }
     }
   }
 
   return EventHandlerResult::OK;
 }
 
+EventHandlerResult TapMod::useKeyChanges() {
+  EventHandlerResult result = KeyChanges::subscribe(key_event);
+  via_key_changes = result == EventHandlerResult::OK;
+  return result;
+}
+
 EventHandlerResult TapMod::onKeyswitchEvent(Key &mappedKey, uint8_t row, uint8_t col, uint8_t keyState) {
-  if (queuing == 0) {
-    if (isTapModKey(mappedKey)) {
-      size_t entry_idx = mappedKey.raw - Key_TapMod01.raw;
-      Entry& entry = entries[entry_idx];
-
-      if (keyToggledOn(keyState)) {
-        switch (entry.state) {
-          case State::IDLE:
-            entry.state = State::PRESSED_IDLE;
-            listening = true;
-            waiting = true;
-
-            entry.pressed_ts = Kaleidoscope_::millisAtCycleStart();
-            mappedKey = entry.actual_key;
-            return EventHandlerResult::OK;
-          default:
-            return EventHandlerResult::ERROR;
-        }
-      }
+  if (via_key_changes) {
+    return EventHandlerResult::OK;
+  }
 
-      if (keyToggledOff(keyState)) {
-        switch (entry.state) {
-          case State::PRESSED_IDLE:
-            // Time-based state transitions are handled earlier.
-            entry.state = State::PRESSED_DELAYED;
-            injecting = true;
-            return EventHandlerResult::EVENT_CONSUMED;
-          case State::PRESSED_PRE_QUEUE:
-            // Time-based state transitions are handled earlier, so this is the same as
-            // PRESSED_REAL.
-          case State::PRESSED_REAL:
-            entry.state = State::IDLE;
-            mappedKey = entry.actual_key;
-            return EventHandlerResult::OK;
-          default:
-            return EventHandlerResult::ERROR;
-        }
-      }
+  return key_event(mappedKey, row, col, keyState);
+}
 
-      if (keyWasPressed(keyState) && keyIsPressed(keyState)) {
-        switch (entry.state) {
-          case State::PRESSED_IDLE:
-          case State::PRESSED_PRE_QUEUE:
-          case State::PRESSED_REAL:
-            mappedKey = entry.actual_key;
-            return EventHandlerResult::OK;
-          default:
-            return EventHandlerResult::ERROR;
-        }
-      }
+EventHandlerResult TapMod::key_event(Key &mappedKey, uint8_t row, uint8_t col, uint8_t keyState) {
+  if (rebuilding) {
+    if (isTapModKey(mappedKey)) {
+      mappedKey = entries[mappedKey.raw - Key_TapMod(0).raw].actual_key;
+    }
+    return EventHandlerResult::OK;
+  }
 
-      return EventHandlerResult::ERROR;
+  EventHandlerResult result = handle_event(mappedKey, row, col, keyState);
+
+  if (result == EventHandlerResult::OK && row < ROWS && col < COLS) {
+    uint16_t pos = (uint16_t)row * COLS + col;
+    uint8_t bit = 1 << (pos % 8);
+    if (keyIsPressed(keyState)) {
+      report_held[pos / 8] |= bit;
+    } else {
+      report_held[pos / 8] &= ~bit;
     }
+  }
+  return result;
+}
+
+EventHandlerResult TapMod::handle_event(Key &mappedKey, uint8_t row, uint8_t col, uint8_t keyState) {
+  if (KeyOwners::mayOwn(KeyOwner::TAPMOD, row, col) && isTapModKey(mappedKey)) {
+    size_t entry_idx = mappedKey.raw - Key_TapMod(0).raw;
+    Event event = keyToggledOn(keyState) ? Event::KEY_DOWN
+                  : keyToggledOff(keyState) ? Event::KEY_UP
+                  : Event::KEY_HELD;
+    return dispatch(entry_idx, event, mappedKey);
+  }
+
+  if (permissive_hold && !replaying && keyToggledOff(keyState)) {
+    resolve_nested(row, col);
+  }
+
+  if (!replaying && keyToggledOn(keyState) && queuing == 0 && queue_len == 0) {
+    // A further real key while an entry is undecided.
+    for (size_t byte_idx = 0; byte_idx < ACTIVE_SIZE; byte_idx++) {
+      uint8_t bits = active[byte_idx];
 
-    if (listening && keyToggledOn(keyState) && !shouldSkipKey(mappedKey)) {
-      real_key_down_this_cycle = true;
+      while (bits != 0) {
+        size_t entry_idx = byte_idx * 8 + __builtin_ctz(bits);
+        bits &= bits - 1;
+
+        dispatch(entry_idx, Event::FURTHER_DOWN);
+      }
     }
-    return EventHandlerResult::OK;
   }
 
-  return EventHandlerResult::ERROR;
+  // Keep queuing until the queue was replayed, so later events can't overtake it.
+  if (!replaying && (queuing > 0 || queue_len > 0)) {
+    return queue_key(row, col, keyState);
+  }
+
+  if (listening && keyToggledOn(keyState) && !shouldSkipKey(mappedKey)) {
+    real_key_down_this_cycle = true;
+    last_down_row = row;
+    last_down_col = col;
+  }
+  return EventHandlerResult::OK;
 }
 
 EventHandlerResult TapMod::beforeReportingState() {
+  if (queuing == 0 && queue_len > 0) {
+    flush_queue();
+  }
+
   if (injecting) {
     injecting = false;
 
-    for (size_t entry_idx = 0; entry_idx < ENTRY_CNT; entry_idx++) {
-      Entry& entry = entries[entry_idx];
-
-      switch (entry.state) {
-        case State::PRESSED_DELAYED:
-          handleKeyswitchEvent(entry.actual_key, entry.src_row, entry.src_col, IS_PRESSED | WAS_PRESSED);
-          injecting = true;
-          break;
-        case State::RELEASE_THIS_CYCLE:
-          handleKeyswitchEvent(entry.actual_key, entry.src_row, entry.src_col, WAS_PRESSED);
-          entry.state = State::IDLE;
-          break;
-        default:
-          break;
+    for (size_t byte_idx = 0; byte_idx < ACTIVE_SIZE; byte_idx++) {
+      uint8_t bits = active[byte_idx];
+
+      while (bits != 0) {
+        size_t entry_idx = byte_idx * 8 + __builtin_ctz(bits);
+        bits &= bits - 1;
+
+        dispatch(entry_idx, Event::INJECT);
       }
     }
   }
@@ -149,22 +231,16 @@ EventHandlerResult TapMod::beforeReportingState() {
   if (listening && real_key_down_this_cycle) {
     listening = false;
 
-    for (size_t entry_idx = 0; entry_idx < ENTRY_CNT; entry_idx++) {
-      Entry& entry = entries[entry_idx];
+    for (size_t byte_idx = 0; byte_idx < ACTIVE_SIZE; byte_idx++) {
+      uint8_t bits = active[byte_idx];
 
-      switch (entry.state) {
-        case State::PRESSED_IDLE:
-          entry.state = State::PRESSED_PRE_QUEUE;
-          break;
-        case State::PRESSED_PRE_QUEUE:
+      while (bits != 0) {
+        size_t entry_idx = byte_idx * 8 + __builtin_ctz(bits);
+        bits &= bits - 1;
+
+        if (dispatch(entry_idx, Event::REAL_DOWN) == EventHandlerResult::ERROR) {
           return EventHandlerResult::ERROR;
-        case State::PRESSED_DELAYED:
-          hid::sendKeyboardReport();
-          handleKeyswitchEvent(entry.actual_key, entry.src_row, entry.src_col, WAS_PRESSED);
-          entry.state = State::IDLE;
-          break;
-        default:
-          break;
+        }
       }
     }
   }
@@ -173,42 +249,400 @@ EventHandlerResult TapMod::beforeReportingState() {
 }
 
 bool TapMod::isTapModKey(Key key) {
-  return (Key_TapMod01 <= key && key <= Key_TapMod04);
+  return (Key_TapMod(0) <= key && key <= Key_TapMod(ENTRY_CNT - 1));
 }
 
-bool TapMod::shouldSkipKey(Key _key) {
-  return false;
+void TapMod::setState(size_t entry_idx, State state) {
+  Entry& entry = entries[entry_idx];
+  bool changed = entry.state != state;
+  entry.state = state;
+
+  if (changed && timer(state) != Timer::NONE) {
+    Deadlines::setEarlier(DeadlineSlot::TAPMOD, deadline(entry_idx));
+  }
+
+  uint8_t bit = 1 << (entry_idx % 8);
+  if (state == State::IDLE) {
+    active[entry_idx / 8] &= ~bit;
+  } else {
+    active[entry_idx / 8] |= bit;
+  }
 }
 
-uint8_t TapMod::find_last_queue_state(Key key, uint8_t pos_addr) {
-  for (size_t i = queue_len; i > 0;) {
-    i -= 1;
-    QueueItem& item = queue[(queue_head + i) % QUEUE_MAX];
-    if (item.key == key && item.pos_addr == pos_addr) {
-      return item.key_state;
+EventHandlerResult TapMod::dispatch(size_t entry_idx, Event event, Key &mappedKey) {
+  static_assert(transitions_complete(0), "TRANSITIONS must handle every event in every state.");
+
+  Entry& entry = entries[entry_idx];
+  Transition t = transition(entry.state, event);
+  EventHandlerResult result = EventHandlerResult::OK;
+
+  switch (t.action) {
+    case Action::NONE:
+      break;
+    case Action::PRESS:
+      listening = true;
+
+      entry.overlapped = false;
+      entry.pressed_ts = Deadlines::now();
+      mappedKey = entry.actual_key;
+      break;
+    case Action::HOLD:
+      mappedKey = entry.actual_key;
+      break;
+    case Action::TAP:
+      // Time-based state transitions are handled earlier.
+      sampleTap(entry_idx, (Deadlines::tick_t)(Deadlines::now() - entry.pressed_ts));
+      injecting = true;
+      result = EventHandlerResult::EVENT_CONSUMED;
+      break;
+    case Action::DECIDE_RELEASE:
+      // A tap, the queued keys follow the release of the actual key.
+      queuing -= 1;
+      // Fall through.
+    case Action::RELEASE:
+      if (!entry.overlapped) {
+        // Held too long for a tap, but nothing was modified, so likely a tap that was
+        // too slow.
+        ts_millis_t duration_ms = (Deadlines::tick_t)(Deadlines::now() - entry.pressed_ts);
+        if (duration_ms <= tap_bounds.max_ms) {
+          sampleTap(entry_idx, duration_ms);
+        }
+      }
+      mappedKey = entry.actual_key;
+      break;
+    case Action::DECIDE:
+      // Replayed once all entries are decided, see `beforeReportingState`.
+      queuing -= 1;
+      break;
+    case Action::START_QUEUE:
+      queuing += 1;
+      break;
+    case Action::NEST:
+      entry.overlapped = true;
+      entry.nested_row = last_down_row;
+      entry.nested_col = last_down_col;
+      break;
+    case Action::FLUSH_TAP:
+      sampleActive(entry_idx, (Deadlines::tick_t)(Deadlines::now() - entry.pressed_ts));
+      ReportGate::send();
+      handleKeyswitchEvent(entry.actual_key, entry.src_row, entry.src_col, WAS_PRESSED);
+      break;
+    case Action::INJECT_HELD:
+      handleKeyswitchEvent(entry.actual_key, entry.src_row, entry.src_col, IS_PRESSED | WAS_PRESSED);
+      injecting = true;
+      break;
+    case Action::INJECT_RELEASE:
+      handleKeyswitchEvent(entry.actual_key, entry.src_row, entry.src_col, WAS_PRESSED);
+      break;
+    default:
+      // ERROR, or MISSING (which `transitions_complete` rules out).
+      return EventHandlerResult::ERROR;
+  }
+
+  setState(entry_idx, t.next);
+  return result;
+}
+
+Deadlines::tick_t TapMod::deadline(size_t entry_idx) {
+  const Entry& entry = entries[entry_idx];
+  uint16_t limit_ms = timer(entry.state) == Timer::ACTIVE ? activeTime(entry_idx) : tapTime(entry_idx);
+  return entry.pressed_ts + limit_ms;
+}
+
+void TapMod::learn(uint16_t& avg8, uint16_t& dev4, ts_millis_t sample) {
+  if (sample > MAX_SAMPLE_MS) {
+    sample = MAX_SAMPLE_MS;
+  } else if (sample == 0) {
+    // Zero means "no samples yet".
+    sample = 1;
+  }
+
+  if (avg8 == 0) {
+    avg8 = sample << 3;
+    dev4 = sample << 1;
+    return;
+  }
+
+  // avg += err / 8, dev += (|err| - dev) / 4.
+  int16_t err = (int16_t)sample - (int16_t)(avg8 >> 3);
+  avg8 += err;
+  dev4 += (err < 0 ? -err : err) - (dev4 >> 2);
+}
+
+uint16_t TapMod::window(uint16_t avg8, uint16_t dev4, uint16_t initial, Bounds bounds) {
+  // avg + 4 * dev.
+  uint16_t ms = avg8 == 0 ? initial : (avg8 >> 3) + dev4;
+
+  if (ms < bounds.min_ms) {
+    return bounds.min_ms;
+  }
+  if (ms > bounds.max_ms) {
+    return bounds.max_ms;
+  }
+  return ms;
+}
+
+void TapMod::sampleTap(size_t idx, ts_millis_t duration_ms) {
+  if (!adaptive) {
+    return;
+  }
+
+  learn(timings[idx].tap_avg8, timings[idx].tap_dev4, duration_ms);
+  persist(idx);
+}
+
+void TapMod::sampleActive(size_t idx, ts_millis_t delay_ms) {
+  if (!adaptive) {
+    return;
+  }
+
+  learn(timings[idx].active_avg8, timings[idx].active_dev4, delay_ms);
+  persist(idx);
+}
+
+void TapMod::persist(size_t idx) {
+  uint16_t tap_ms = tapTime(idx);
+  uint16_t active_ms = activeTime(idx);
+  Saved& last = saved[idx];
+
+  // Don't wear out the EEPROM with every small change.
+  if (abs((int16_t)(tap_ms - last.tap_ms)) < CAL_TAPMOD_SAVE_DELTA_MS
+      && abs((int16_t)(active_ms - last.active_ms)) < CAL_TAPMOD_SAVE_DELTA_MS) {
+    return;
+  }
+
+  last = Saved { tap_ms, active_ms };
+#if CAL_TAPMOD_EEPROM
+  EEPROM.put(eeprom_base + idx * sizeof(Timing), timings[idx]);
+#endif
+}
+
+void TapMod::resolve_nested(uint8_t row, uint8_t col) {
+  // Queued presses happened while the QUEUING entries were held.
+  bool queued_press = queuing > 0 && row < ROWS && col < COLS
+                      && last_queue_state((uint16_t)row * COLS + col);
+
+  for (size_t byte_idx = 0; byte_idx < ACTIVE_SIZE; byte_idx++) {
+    uint8_t bits = active[byte_idx];
+
+    while (bits != 0) {
+      size_t entry_idx = byte_idx * 8 + __builtin_ctz(bits);
+      bits &= bits - 1;
+
+      const Entry& entry = entries[entry_idx];
+
+      if ((entry.nested_row == row && entry.nested_col == col)
+          || (queued_press && entry.state == State::QUEUING)) {
+        // Only leaves PRESSED_PRE_QUEUE or QUEUING, and replays the queue at the end of
+        // this cycle.
+        dispatch(entry_idx, Event::NESTED_UP);
+      }
+    }
+  }
+}
+
+EventHandlerResult TapMod::queue_key(uint8_t row, uint8_t col, uint8_t key_state) {
+  if (row >= ROWS || col >= COLS) {
+    // Injected, not a real position.
+    return EventHandlerResult::OK;
+  }
+
+  uint16_t pos = (uint16_t)row * COLS + col;
+  uint8_t bit = 1 << (pos % 8);
+
+  if (!keyToggledOn(key_state) && !keyToggledOff(key_state)) {
+    // Held, only held back if the press wasn't replayed yet.
+    return last_queue_state(pos) ? EventHandlerResult::EVENT_CONSUMED : EventHandlerResult::OK;
+  }
+
+  if (queue_len == QUEUE_MAX) {
+    if (!overflowed) {
+      // Out of space, decide that the undecided entries are held. The queue is replayed
+      // before reporting, once the whole scan was seen.
+      overflowed = true;
+
+      for (size_t byte_idx = 0; byte_idx < ACTIVE_SIZE; byte_idx++) {
+        uint8_t bits = active[byte_idx];
+
+        while (bits != 0) {
+          size_t entry_idx = byte_idx * 8 + __builtin_ctz(bits);
+          bits &= bits - 1;
+
+          dispatch(entry_idx, Event::QUEUE_FULL);
+        }
+      }
+    }
+
+    overflow_toggled[pos / 8] |= bit;
+    if (keyToggledOn(key_state)) {
+      overflow_pressed[pos / 8] |= bit;
+    } else {
+      overflow_pressed[pos / 8] &= ~bit;
+    }
+    return EventHandlerResult::EVENT_CONSUMED;
+  }
+
+  queue[queue_len++] = QueueItem { row, col, key_state };
+  if (keyToggledOn(key_state)) {
+    queue_pressed[pos / 8] |= bit;
+  } else {
+    queue_pressed[pos / 8] &= ~bit;
+  }
+  return EventHandlerResult::EVENT_CONSUMED;
+}
+
+void TapMod::flush_queue() {
+  replaying = true;
+
+  size_t replayed = 0;
+  for (; replayed < queue_len; replayed++) {
+    // Each event gets a report, so a tap isn't collapsed.
+    if (!next_report(replayed)) {
+      break;
+    }
+
+    const QueueItem& item = queue[replayed];
+    // Looked up now, e.g. after a layer key was released.
+    handleKeyswitchEvent(Key_NoKey, item.row, item.col, item.key_state);
+  }
+
+  if (replayed < queue_len) {
+    // The rest is replayed on a later cycle, behind which new events are queued.
+    queue_len -= replayed;
+    memmove(&queue[0], &queue[replayed], queue_len * sizeof(QueueItem));
+
+    memset(queue_pressed, 0, sizeof(queue_pressed));
+    for (size_t i = 0; i < queue_len; i++) {
+      const QueueItem& item = queue[i];
+      uint16_t pos = (uint16_t)item.row * COLS + item.col;
+      if (keyToggledOn(item.key_state)) {
+        queue_pressed[pos / 8] |= 1 << (pos % 8);
+      } else {
+        queue_pressed[pos / 8] &= ~(1 << (pos % 8));
+      }
     }
+
+    replaying = false;
+    return;
   }
-  return 0;
+
+  if (overflowed) {
+    next_report(queue_len);
+
+    for (size_t byte_idx = 0; byte_idx < POS_SIZE; byte_idx++) {
+      uint8_t bits = overflow_toggled[byte_idx];
+
+      while (bits != 0) {
+        uint8_t bit = __builtin_ctz(bits);
+        bits &= bits - 1;
+
+        uint16_t pos = byte_idx * 8 + bit;
+        uint8_t key_state = (overflow_pressed[byte_idx] >> bit) & 1 ? IS_PRESSED : WAS_PRESSED;
+        handleKeyswitchEvent(Key_NoKey, pos / COLS, pos % COLS, key_state);
+      }
+    }
+  }
+
+  queue_len = 0;
+  memset(queue_pressed, 0, sizeof(queue_pressed));
+  overflowed = false;
+  memset(overflow_toggled, 0, sizeof(overflow_toggled));
+  memset(overflow_pressed, 0, sizeof(overflow_pressed));
+  replaying = false;
 }
 
-void TapMod::queue_key(Key key, uint8_t pos_addr, uint8_t key_state) {
-  if (queue_len >= QUEUE_MAX) return;
-  QueueItem& item = queue[(queue_head + queue_len) % QUEUE_MAX];
-  item.key = key;
-  item.pos_addr = pos_addr;
-  item.key_state = key_state;
-  queue_len += 1;
+bool TapMod::next_report(size_t next_idx) {
+  uint8_t held[POS_SIZE] = { 0 };
+
+  if (next_idx > 0) {
+    ReportGate::send();
+    // Kaleidoscope only adds pressed keys to the report, so released ones would stay.
+    ReportGate::releaseAllKeys();
+    memcpy(held, report_held, sizeof(held));
+    if (via_key_changes) {
+      // Keys held since their press (including TapMod keys) don't reach TapMod.
+      KeyChanges::addPassedOn(held);
+    }
+  }
+
+  // Otherwise the report stays as it is before the item, until a later cycle. The rest
+  // of an overflowing scan can't wait, since the next scan needs the space.
+  bool wait = !overflowed && !ReportGate::ready();
+
+  // Positions whose events are replayed from now on. A key released later is still held
+  // (scanned or not), and the next event brings its own key.
+  uint8_t seen[POS_SIZE] = { 0 };
+  for (size_t i = next_idx; i < queue_len; i++) {
+    const QueueItem& item = queue[i];
+    uint16_t pos = (uint16_t)item.row * COLS + item.col;
+    uint8_t bit = 1 << (pos % 8);
+
+    if (!(seen[pos / 8] & bit)) {
+      if ((wait || i > next_idx) && keyToggledOff(item.key_state)) {
+        held[pos / 8] |= bit;
+      } else {
+        held[pos / 8] &= ~bit;
+      }
+    }
+    seen[pos / 8] |= bit;
+  }
+
+  if (overflowed) {
+    for (size_t byte_idx = 0; byte_idx < POS_SIZE; byte_idx++) {
+      uint8_t toggled = overflow_toggled[byte_idx] & ~seen[byte_idx];
+      if (next_idx < queue_len) {
+        held[byte_idx] |= toggled & ~overflow_pressed[byte_idx];
+      } else {
+        held[byte_idx] &= ~toggled;
+      }
+    }
+  }
+
+  rebuilding = true;
+  for (size_t byte_idx = 0; byte_idx < POS_SIZE; byte_idx++) {
+    uint8_t bits = held[byte_idx];
+
+    while (bits != 0) {
+      uint8_t bit = __builtin_ctz(bits);
+      bits &= bits - 1;
+
+      uint16_t pos = byte_idx * 8 + bit;
+      handleKeyswitchEvent(Key_NoKey, pos / COLS, pos % COLS, IS_PRESSED | WAS_PRESSED);
+    }
+  }
+  rebuilding = false;
+
+  return !wait;
+}
+
+bool TapMod::shouldSkipKey(Key _key) {
+  return false;
 }
 
 void TapMod::reset() {
   memset(entries, 0, sizeof(entries));
-  memset(queue, 0, sizeof(queue));
-  queue_len = 0;
-  queue_head = 0;
+  memset(active, 0, sizeof(active));
   listening = 0;
-  waiting = 0;
+  Deadlines::clear(DeadlineSlot::TAPMOD);
   injecting = 0;
   queuing = 0;
+  queue_len = 0;
+  memset(queue_pressed, 0, sizeof(queue_pressed));
+  overflowed = false;
+  memset(overflow_toggled, 0, sizeof(overflow_toggled));
+  memset(overflow_pressed, 0, sizeof(overflow_pressed));
+  replaying = false;
+  memset(report_held, 0, sizeof(report_held));
+  rebuilding = false;
+  last_down_row = 0;
+  last_down_col = 0;
+  permissive_hold = false;
+  via_key_changes = false;
+  adaptive = false;
+  tap_bounds = Bounds { CAL_TAPMOD_TAP_MIN_MS, CAL_TAPMOD_TAP_MAX_MS };
+  active_bounds = Bounds { CAL_TAPMOD_ACTIVE_MIN_MS, CAL_TAPMOD_ACTIVE_MAX_MS };
+  memset(timings, 0, sizeof(timings));
+  memset(saved, 0, sizeof(saved));
 }
 
 }
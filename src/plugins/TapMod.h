@@ -3,11 +3,56 @@
 #include <kaleidoscope/plugin.h>
 #include <Kaleidoscope-Ranges.h>
 #include <kaleidoscope/key_defs.h>
+#include <kaleidoscope/keyswitch_state.h>
+#include <Kaleidoscope.h>
+#include "Deadlines.h"
+#include "KeyChanges.h"
 
-#define Key_TapMod01 Key(kaleidoscope::ranges::KALEIDOSCOPE_SAFE_START + 1)
-#define Key_TapMod02 Key(kaleidoscope::ranges::KALEIDOSCOPE_SAFE_START + 2)
-#define Key_TapMod03 Key(kaleidoscope::ranges::KALEIDOSCOPE_SAFE_START + 3)
-#define Key_TapMod04 Key(kaleidoscope::ranges::KALEIDOSCOPE_SAFE_START + 4)
+/// Key of the TapMod entry `idx` (starting at 0).
+#define Key_TapMod(idx) Key(kaleidoscope::ranges::KALEIDOSCOPE_SAFE_START + 1 + (idx))
+
+#define Key_TapMod01 Key_TapMod(0)
+#define Key_TapMod02 Key_TapMod(1)
+#define Key_TapMod03 Key_TapMod(2)
+#define Key_TapMod04 Key_TapMod(3)
+
+/// Number of TapMod entries (and keys).
+#ifndef CAL_TAPMOD_ENTRIES
+#define CAL_TAPMOD_ENTRIES 4
+#endif
+
+/// Maximum number of key toggles held back while a TapMod key is undecided.
+#ifndef CAL_TAPMOD_QUEUE_SIZE
+#define CAL_TAPMOD_QUEUE_SIZE 16
+#endif
+
+/// Default bounds (in ms) of the learned tap timeout, see `TapMod::setAdaptive`.
+#ifndef CAL_TAPMOD_TAP_MIN_MS
+#define CAL_TAPMOD_TAP_MIN_MS 100
+#endif
+#ifndef CAL_TAPMOD_TAP_MAX_MS
+#define CAL_TAPMOD_TAP_MAX_MS 250
+#endif
+
+/// Default bounds (in ms, since the press) of how long a tapped key waits for the
+/// next key, when learned.
+#ifndef CAL_TAPMOD_ACTIVE_MIN_MS
+#define CAL_TAPMOD_ACTIVE_MIN_MS 150
+#endif
+#ifndef CAL_TAPMOD_ACTIVE_MAX_MS
+#define CAL_TAPMOD_ACTIVE_MAX_MS 500
+#endif
+
+/// How far (in ms) a learned timeout must move before it is persisted again.
+#ifndef CAL_TAPMOD_SAVE_DELTA_MS
+#define CAL_TAPMOD_SAVE_DELTA_MS 8
+#endif
+
+/// Set to 1 to persist the learned timings in EEPROM (needs the EEPROM-Settings
+/// plugin sources). The sketch must register EEPROMSettings and seal it after setup.
+#ifndef CAL_TAPMOD_EEPROM
+#define CAL_TAPMOD_EEPROM 0
+#endif
 
 namespace custom {
 
@@ -17,10 +62,69 @@ typedef unsigned long ts_millis_t;
 
 class TapMod : public Plugin {
   friend class TapModTest;
+  friend class KeyChangesTapModTest;
+  friend class TapModReportGateTest;
+  friend class KeyOwnersTest;
 
   public:
     static void setActual(size_t idx, Key actual);
 
+    /// Receive key events through `KeyChanges`, so held keys cost no work each cycle.
+    /// `KeyChanges` must be registered in TapMod's place (TapMod itself is still needed
+    /// for its other hooks).
+    static EventHandlerResult useKeyChanges();
+
+    /// Learn the timeouts of each key from how it is typed: The tap timeout from the
+    /// duration of taps (and of holds without any other key, which were meant as taps),
+    /// and how long a tapped key waits for the next key from the delay until it came.
+    /// Each timeout is the smoothed mean plus four times the smoothed mean deviation
+    /// (like TCP's retransmission timeout), within the configured bounds.
+    static void setAdaptive(bool enabled) {
+      adaptive = enabled;
+    }
+
+    /// Decide that a key is held as soon as another key was pressed and released while
+    /// it is held, instead of waiting for the tap timeout.
+    static void setPermissiveHold(bool enabled) {
+      permissive_hold = enabled;
+    }
+
+    static void setTapTimeBounds(uint16_t min_ms, uint16_t max_ms) {
+      tap_bounds = Bounds { min_ms, max_ms };
+    }
+
+    static void setActiveTimeBounds(uint16_t min_ms, uint16_t max_ms) {
+      active_bounds = Bounds { min_ms, max_ms };
+    }
+
+    /// Online statistics of an entry, in fixed point. All zero until the first sample.
+    struct Timing {
+      /// Smoothed tap duration, in ms * 8.
+      uint16_t tap_avg8;
+      /// Smoothed mean deviation of the tap duration, in ms * 4.
+      uint16_t tap_dev4;
+      /// Smoothed time from a tap's press to the next key, in ms * 8.
+      uint16_t active_avg8;
+      /// Smoothed mean deviation of that time, in ms * 4.
+      uint16_t active_dev4;
+    };
+
+    /// The learned statistics of entry `idx`, e.g. to persist them elsewhere.
+    static const Timing& timing(size_t idx) {
+      return timings[idx];
+    }
+
+    /// Restore previously learned statistics. Fails for invalid (e.g. erased) values.
+    static EventHandlerResult setTiming(size_t idx, const Timing& timing);
+
+    /// The tap timeout of entry `idx` currently in use.
+    static uint16_t tapTime(size_t idx);
+    /// How long (since the press) tapped entry `idx` currently waits for the next key.
+    static uint16_t activeTime(size_t idx);
+
+#if CAL_TAPMOD_EEPROM
+    EventHandlerResult onSetup();
+#endif
     EventHandlerResult beforeEachCycle();
     EventHandlerResult onKeyswitchEvent(Key &mappedKey, uint8_t row, uint8_t col, uint8_t keyState);
     EventHandlerResult beforeReportingState();
@@ -38,54 +142,291 @@ class TapMod : public Plugin {
       PRESSED_REAL,
       /// Key should be released in this cycle.
       RELEASE_THIS_CYCLE,
-      /// Key presses are being queued for later.
+      /// Like PRESSED_PRE_QUEUE, but more real keys were pressed. Their events are queued
+      /// until the key is released (a tap, so they follow the actual key's release) or
+      /// the timeout (a hold, so they are modified as well).
       QUEUING,
     };
 
+    /// What happened to an entry, see `TRANSITIONS`.
+    enum class Event : uint8_t {
+      /// The TapMod key was pressed.
+      KEY_DOWN = 0,
+      /// The TapMod key is still held.
+      KEY_HELD,
+      /// The TapMod key was released.
+      KEY_UP,
+      /// The timeout of the state (see `TIMERS`) expired.
+      TIMEOUT,
+      /// The first real key since the press was pressed (seen at the end of the cycle).
+      REAL_DOWN,
+      /// Another real key was pressed (seen right away).
+      FURTHER_DOWN,
+      /// With permissive hold, a real key pressed while the key was held was released.
+      NESTED_UP,
+      /// The actual key may be injected, before reporting.
+      INJECT,
+      /// The queue ran full.
+      QUEUE_FULL,
+    };
+
+    /// What to do on a transition, besides changing the state.
+    enum class Action : uint8_t {
+      /// Zero, so an entry missing from `TRANSITIONS` is detected.
+      MISSING = 0,
+      NONE,
+      /// The event is invalid in this state.
+      ERROR,
+      /// Record the press and press the actual key.
+      PRESS,
+      /// Keep the actual key pressed.
+      HOLD,
+      /// Consume the release of a tap and start injecting the actual key.
+      TAP,
+      /// Release the actual key.
+      RELEASE,
+      /// Leave QUEUING, then like RELEASE.
+      DECIDE_RELEASE,
+      /// Leave QUEUING, its queue is replayed once no entry is queuing anymore.
+      DECIDE,
+      /// Enter QUEUING.
+      START_QUEUE,
+      /// Remember the first real key.
+      NEST,
+      /// Release the injected actual key, after the report with the real key.
+      FLUSH_TAP,
+      /// Inject the actual key as held.
+      INJECT_HELD,
+      /// Inject the release of the actual key.
+      INJECT_RELEASE,
+    };
+
+    /// Which timeout applies in a state.
+    enum class Timer : uint8_t {
+      NONE = 0,
+      /// `tapTime`, since the press.
+      TAP,
+      /// `activeTime`, since the press.
+      ACTIVE,
+    };
+
+    struct Transition {
+      State next;
+      Action action;
+    };
+
+    static constexpr uint8_t STATE_CNT = (uint8_t)State::QUEUING + 1;
+    static constexpr uint8_t EVENT_CNT = (uint8_t)Event::QUEUE_FULL + 1;
+
+    /// The transition of an entry in state `state` on `event`.
+    static Transition transition(State state, Event event) {
+      const Transition& t = TRANSITIONS[(uint8_t)state][(uint8_t)event];
+      return Transition { (State)pgm_read_byte(&t.next), (Action)pgm_read_byte(&t.action) };
+    }
+
+    static Timer timer(State state) {
+      return (Timer)pgm_read_byte(&TIMERS[(uint8_t)state]);
+    }
+
     struct Entry {
-      ts_millis_t pressed_ts;
+      Deadlines::tick_t pressed_ts;
       Key actual_key;
       uint8_t src_row;
       uint8_t src_col;
       State state;
+      /// A real key was pressed while the key was held.
+      bool overlapped;
+      /// Position of that first real key.
+      uint8_t nested_row;
+      uint8_t nested_col;
     };
 
     struct QueueItem {
-      Key key;
-      uint8_t pos_addr;
+      uint8_t row;
+      uint8_t col;
       uint8_t key_state;
     };
 
   private:
-    static const size_t QUEUE_MAX = 16;
-    static const size_t ENTRY_CNT = 4;
+#define CAL_TAPMOD_T(next, action) { State::next, Action::action }
+    /// The state machine of each entry, indexed by state and event. Events that don't
+    /// apply to a state (e.g. broadcast to all active entries) leave it unchanged.
+    static constexpr Transition TRANSITIONS[STATE_CNT][EVENT_CNT] PROGMEM = {
+      // KEY_DOWN, KEY_HELD, KEY_UP,
+      // TIMEOUT, REAL_DOWN, FURTHER_DOWN,
+      // NESTED_UP, INJECT, QUEUE_FULL
+      /* IDLE */ {
+        CAL_TAPMOD_T(PRESSED_IDLE, PRESS), CAL_TAPMOD_T(IDLE, ERROR), CAL_TAPMOD_T(IDLE, ERROR),
+        CAL_TAPMOD_T(IDLE, NONE), CAL_TAPMOD_T(IDLE, NONE), CAL_TAPMOD_T(IDLE, NONE),
+        CAL_TAPMOD_T(IDLE, NONE), CAL_TAPMOD_T(IDLE, NONE), CAL_TAPMOD_T(IDLE, NONE),
+      },
+      /* PRESSED_IDLE */ {
+        CAL_TAPMOD_T(PRESSED_IDLE, ERROR), CAL_TAPMOD_T(PRESSED_IDLE, HOLD), CAL_TAPMOD_T(PRESSED_DELAYED, TAP),
+        CAL_TAPMOD_T(PRESSED_REAL, NONE), CAL_TAPMOD_T(PRESSED_PRE_QUEUE, NEST), CAL_TAPMOD_T(PRESSED_IDLE, NONE),
+        CAL_TAPMOD_T(PRESSED_IDLE, NONE), CAL_TAPMOD_T(PRESSED_IDLE, NONE), CAL_TAPMOD_T(PRESSED_IDLE, NONE),
+      },
+      /* PRESSED_PRE_QUEUE */ {
+        CAL_TAPMOD_T(PRESSED_PRE_QUEUE, ERROR), CAL_TAPMOD_T(PRESSED_PRE_QUEUE, HOLD), CAL_TAPMOD_T(IDLE, RELEASE),
+        CAL_TAPMOD_T(PRESSED_REAL, NONE), CAL_TAPMOD_T(PRESSED_PRE_QUEUE, ERROR), CAL_TAPMOD_T(QUEUING, START_QUEUE),
+        CAL_TAPMOD_T(PRESSED_REAL, NONE), CAL_TAPMOD_T(PRESSED_PRE_QUEUE, NONE), CAL_TAPMOD_T(PRESSED_PRE_QUEUE, NONE),
+      },
+      /* PRESSED_DELAYED */ {
+        CAL_TAPMOD_T(PRESSED_DELAYED, ERROR), CAL_TAPMOD_T(PRESSED_DELAYED, ERROR), CAL_TAPMOD_T(PRESSED_DELAYED, ERROR),
+        CAL_TAPMOD_T(RELEASE_THIS_CYCLE, NONE), CAL_TAPMOD_T(IDLE, FLUSH_TAP), CAL_TAPMOD_T(PRESSED_DELAYED, NONE),
+        CAL_TAPMOD_T(PRESSED_DELAYED, NONE), CAL_TAPMOD_T(PRESSED_DELAYED, INJECT_HELD), CAL_TAPMOD_T(PRESSED_DELAYED, NONE),
+      },
+      /* PRESSED_REAL */ {
+        CAL_TAPMOD_T(PRESSED_REAL, ERROR), CAL_TAPMOD_T(PRESSED_REAL, HOLD), CAL_TAPMOD_T(IDLE, RELEASE),
+        CAL_TAPMOD_T(PRESSED_REAL, NONE), CAL_TAPMOD_T(PRESSED_REAL, NONE), CAL_TAPMOD_T(PRESSED_REAL, NONE),
+        CAL_TAPMOD_T(PRESSED_REAL, NONE), CAL_TAPMOD_T(PRESSED_REAL, NONE), CAL_TAPMOD_T(PRESSED_REAL, NONE),
+      },
+      /* RELEASE_THIS_CYCLE */ {
+        CAL_TAPMOD_T(RELEASE_THIS_CYCLE, ERROR), CAL_TAPMOD_T(RELEASE_THIS_CYCLE, ERROR), CAL_TAPMOD_T(RELEASE_THIS_CYCLE, ERROR),
+        CAL_TAPMOD_T(RELEASE_THIS_CYCLE, NONE), CAL_TAPMOD_T(RELEASE_THIS_CYCLE, NONE), CAL_TAPMOD_T(RELEASE_THIS_CYCLE, NONE),
+        CAL_TAPMOD_T(RELEASE_THIS_CYCLE, NONE), CAL_TAPMOD_T(IDLE, INJECT_RELEASE), CAL_TAPMOD_T(RELEASE_THIS_CYCLE, NONE),
+      },
+      /* QUEUING */ {
+        CAL_TAPMOD_T(QUEUING, ERROR), CAL_TAPMOD_T(QUEUING, HOLD), CAL_TAPMOD_T(IDLE, DECIDE_RELEASE),
+        CAL_TAPMOD_T(PRESSED_REAL, DECIDE), CAL_TAPMOD_T(QUEUING, NONE), CAL_TAPMOD_T(QUEUING, NONE),
+        CAL_TAPMOD_T(PRESSED_REAL, DECIDE), CAL_TAPMOD_T(QUEUING, NONE), CAL_TAPMOD_T(PRESSED_REAL, DECIDE),
+      },
+    };
+#undef CAL_TAPMOD_T
+
+    static constexpr Timer TIMERS[STATE_CNT] PROGMEM = {
+      /* IDLE */ Timer::NONE,
+      /* PRESSED_IDLE */ Timer::TAP,
+      /* PRESSED_PRE_QUEUE */ Timer::TAP,
+      /* PRESSED_DELAYED */ Timer::ACTIVE,
+      /* PRESSED_REAL */ Timer::NONE,
+      /* RELEASE_THIS_CYCLE */ Timer::NONE,
+      /* QUEUING */ Timer::TAP,
+    };
 
+    /// Whether every cell of `TRANSITIONS`, from the flat index `i` on, is filled in.
+    static constexpr bool transitions_complete(size_t i) {
+      return i == (size_t)STATE_CNT * EVENT_CNT
+             || (TRANSITIONS[i / EVENT_CNT][i % EVENT_CNT].action != Action::MISSING
+                 && (uint8_t)TRANSITIONS[i / EVENT_CNT][i % EVENT_CNT].next < STATE_CNT
+                 && transitions_complete(i + 1));
+    }
+
+    static const size_t ENTRY_CNT = CAL_TAPMOD_ENTRIES;
+    static constexpr size_t ACTIVE_SIZE = (ENTRY_CNT + 7) / 8;
+    static const size_t QUEUE_MAX = CAL_TAPMOD_QUEUE_SIZE;
+    static constexpr size_t POS_SIZE = (ROWS * COLS + 7) / 8;
+
+    /// Timeouts used until something was learned.
     static const ts_millis_t TAP_TIME_MS = 180;
     static const ts_millis_t ACTIVE_TIME_MAX_MS = 320;
 
-    static Entry entries[ENTRY_CNT];
+    /// Longest sample, so the fixed point statistics don't overflow.
+    static const ts_millis_t MAX_SAMPLE_MS = 4095;
 
-    static QueueItem queue[QUEUE_MAX];
-    static size_t queue_head;
-    static size_t queue_len;
+    struct Bounds {
+      uint16_t min_ms;
+      uint16_t max_ms;
+    };
+
+    /// Timeouts of an entry when it was last persisted (zero if never).
+    struct Saved {
+      uint16_t tap_ms;
+      uint16_t active_ms;
+    };
+
+    static Entry entries[ENTRY_CNT];
+    /// Bitset of entries which are not IDLE, so each cycle only visits those.
+    static uint8_t active[ACTIVE_SIZE];
 
     static boolean real_key_down_this_cycle;
     /// Listening for a real key down.
     static bool listening;
-    /// Waiting for a timeout.
-    static bool waiting;
     /// Injecting keys.
     static bool injecting;
+    /// Number of entries in QUEUING.
     static uint8_t queuing;
 
+    static QueueItem queue[QUEUE_MAX];
+    static size_t queue_len;
+    /// Bitset of positions whose last queued event is a press, so their hold events
+    /// are held back as well.
+    static uint8_t queue_pressed[POS_SIZE];
+    /// The queue ran full during the current scan. The toggles of the rest of the scan
+    /// (at most one per position) are kept in these bitsets, and replayed after it.
+    static bool overflowed;
+    static uint8_t overflow_toggled[POS_SIZE];
+    static uint8_t overflow_pressed[POS_SIZE];
+    /// Replaying the queue, so its events pass through.
+    static bool replaying;
+    /// Bitset of positions passed on as pressed during the current cycle, to rebuild the
+    /// report between replayed events. Via `KeyChanges`, completed with the held keys
+    /// it passes on by itself.
+    static uint8_t report_held[POS_SIZE];
+    /// Rebuilding the report, so its hold events pass through unchanged.
+    static bool rebuilding;
+
+    /// Position of the last real key pressed while listening.
+    static uint8_t last_down_row;
+    static uint8_t last_down_col;
+
+    static bool permissive_hold;
+    static bool via_key_changes;
+    static bool adaptive;
+    static Bounds tap_bounds;
+    static Bounds active_bounds;
+    static Timing timings[ENTRY_CNT];
+    static Saved saved[ENTRY_CNT];
+#if CAL_TAPMOD_EEPROM
+    static uint16_t eeprom_base;
+#endif
+
+    static void learn(uint16_t& avg8, uint16_t& dev4, ts_millis_t sample);
+    static uint16_t window(uint16_t avg8, uint16_t dev4, uint16_t initial, Bounds bounds);
+    /// Record a tap of entry `idx` that was held for `duration_ms`.
+    static void sampleTap(size_t idx, ts_millis_t duration_ms);
+    /// Record that the next key followed the press of tapped entry `idx` after `delay_ms`.
+    static void sampleActive(size_t idx, ts_millis_t delay_ms);
+    /// Persist the statistics of entry `idx` if its timeouts moved far enough.
+    static void persist(size_t idx);
 
     static bool isTapModKey(Key key);
 
+    /// Changes the state, and arms the timeout of the new state, if any.
+    static void setState(size_t entry_idx, State state);
+    /// When the timeout of the state of timed entry `entry_idx` expires.
+    static Deadlines::tick_t deadline(size_t entry_idx);
+
+    /// Run the transition of entry `entry_idx` on `event`. `mappedKey` is only changed
+    /// for events of the TapMod key itself.
+    static EventHandlerResult dispatch(size_t entry_idx, Event event, Key &mappedKey);
+    static EventHandlerResult dispatch(size_t entry_idx, Event event) {
+      Key key = entries[entry_idx].actual_key;
+      return dispatch(entry_idx, event, key);
+    }
+
     static bool shouldSkipKey(Key key);
 
-    static uint8_t find_last_queue_state(Key key, uint8_t pos_addr);
+    /// Handle a key event, see `onKeyswitchEvent` and `useKeyChanges`.
+    static EventHandlerResult key_event(Key &mappedKey, uint8_t row, uint8_t col, uint8_t keyState);
+    static EventHandlerResult handle_event(Key &mappedKey, uint8_t row, uint8_t col, uint8_t keyState);
+
+    /// With permissive hold, decide undecided entries on the release of a real key
+    /// that was pressed while they were held.
+    static void resolve_nested(uint8_t row, uint8_t col);
+    static EventHandlerResult queue_key(uint8_t row, uint8_t col, uint8_t key_state);
+    /// Replay the queued events in order, then the rest of a scan that overflowed. Each
+    /// report waits for `ReportGate`'s minimum interval, the events after it are kept
+    /// for a later cycle.
+    static void flush_queue();
+    /// Start the report of queue item `next_idx` (the overflow after the last one): Send
+    /// the report so far, and add the keys still held then, including those whose
+    /// release is replayed later. False if the item has to wait for a later cycle.
+    static bool next_report(size_t next_idx);
 
-    static void queue_key(Key key, uint8_t pos_addr, uint8_t key_state);
+    /// The state of position `pos` according to its last queued event.
+    static uint8_t last_queue_state(uint16_t pos) {
+      return (queue_pressed[pos / 8] >> (pos % 8)) & 1 ? IS_PRESSED : 0;
+    }
 
     // For friendly test.
     static void reset();
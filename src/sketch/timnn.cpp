@@ -1,57 +1,12 @@
 #include <Kaleidoscope.h>
+#include <Kaleidoscope-EEPROM-Settings.h>
 #include <Kaleidoscope-HostPowerManagement.h>
 #include <Kaleidoscope-LEDControl.h>
 #include <Kaleidoscope-LEDEffect-SolidColor.h>
+#include <ReportGate.h>
+#include <ScanGovernor.h>
 #include <TapMod.h>
-
-enum { DVORAK, SPECIAL };
-
-// FUTURE: Key_Escape, Key_Enter, Key_Tab
-
-/* *INDENT-OFF* */
-KEYMAPS(
-[DVORAK] = KEYMAP_STACKED
-(
-        Key_NoKey, Key_NoKey,     Key_NoKey, Key_NoKey,  Key_NoKey, Key_NoKey, Key_LEDEffectNext,
-        Key_NoKey, Key_Quote,     Key_Comma, Key_Period, Key_P,     Key_Y,     Key_NoKey,
-        Key_Tab,   Key_A,         Key_O,     Key_E,      Key_U,     Key_I,
-        Key_NoKey, Key_Semicolon, Key_Q,     Key_J,      Key_K,     Key_X,     Key_NoKey,
-
-        Key_NoKey, Key_TapMod01, Key_Backspace, Key_NoKey,
-        Key_TapMod02,
-        // Key_NoKey, OSM(LeftShift), Key_Backspace, Key_NoKey,
-        // OSM(LeftShift),
-
-        Key_NoKey, Key_NoKey, Key_NoKey, Key_NoKey, Key_NoKey, Key_NoKey, Key_NoKey,
-        Key_NoKey, Key_F,     Key_G,     Key_C,     Key_R,     Key_L,     Key_NoKey,
-        Key_D,     Key_H,     Key_T,     Key_N,     Key_S,     Key_Enter,
-        Key_NoKey, Key_B,     Key_M,     Key_W,     Key_V,     Key_Z,     Key_NoKey,
-
-        Key_NoKey, Key_TapMod03, Key_Spacebar, Key_NoKey,
-        Key_TapMod04
-        // Key_NoKey, OSL(SPECIAL), Key_Spacebar, Key_NoKey,
-        // OSL(SPECIAL)
-),
-[SPECIAL] = KEYMAP_STACKED
-(
-        Key_NoKey, Key_NoKey, Key_NoKey, Key_NoKey, Key_NoKey, Key_NoKey,     Key_NoKey,
-        Key_NoKey, ___,       ___,       ___,       Key_Slash, Key_Backslash, Key_NoKey,
-        ___,       Key_1,     Key_2,     Key_3,     Key_4,     Key_5,
-        Key_NoKey, ___,       Key_NoKey, Key_NoKey, Key_NoKey, Key_NoKey,     Key_NoKey,
-
-        Key_NoKey, ___, ___, Key_NoKey,
-        Key_NoKey,
-
-        Key_NoKey, Key_NoKey,    Key_NoKey, Key_NoKey,  Key_NoKey,       Key_NoKey,        Key_NoKey,
-        Key_NoKey, Key_Backtick, Key_Minus, Key_Equals, Key_LeftBracket, Key_RightBracket, Key_NoKey,
-        Key_6,        Key_7,     Key_8,      Key_9,           Key_0,            ___,
-        Key_NoKey, Key_NoKey,    Key_NoKey, Key_NoKey,  Key_NoKey,       Key_NoKey,        Key_NoKey,
-
-        Key_NoKey, Key_NoKey, ___, Key_NoKey,
-        ___
-),
-)
-/* *INDENT-ON* */
+#include "timnn_keymap.h"
 
 static kaleidoscope::plugin::LEDSolidColor ledSolid(255, 0, 219);
 
@@ -61,8 +16,10 @@ void hostPowerManagementEventHandler(kaleidoscope::plugin::HostPowerManagement::
             kaleidoscope::plugin::LEDControl::set_all_leds_to({0, 0, 0});
             kaleidoscope::plugin::LEDControl::syncLeds();
             kaleidoscope::plugin::LEDControl::paused = true;
+            custom::ScanGovernor::hostSuspended();
             break;
         case kaleidoscope::plugin::HostPowerManagement::Resume:
+            custom::ScanGovernor::hostResumed();
             kaleidoscope::plugin::LEDControl::paused = false;
             kaleidoscope::plugin::LEDControl::refreshAll();
             break;
@@ -73,20 +30,30 @@ void hostPowerManagementEventHandler(kaleidoscope::plugin::HostPowerManagement::
 
 
 KALEIDOSCOPE_INIT_PLUGINS(
-    TapMod,
-    LEDControl, HostPowerManagement, LEDOff, ledSolid)
+    EEPROMSettings,
+    ScanGovernor, TapMod,
+    LEDControl, HostPowerManagement, LEDOff, ledSolid,
+    ReportGate)
 
 void setup() {
   custom::TapMod::setActual(0, Key_LeftShift);
   custom::TapMod::setActual(1, Key_LeftShift);
   custom::TapMod::setActual(2, ShiftToLayer(SPECIAL));
   custom::TapMod::setActual(3, ShiftToLayer(SPECIAL));
+  // The host polls every ms, so it sees each report of a replayed burst.
+  custom::ReportGate::setMinInterval(1);
 
   Kaleidoscope.setup();
+  // TapMod requested its slice during setup.
+  EEPROMSettings.seal();
 
   // ledSolid.activate();
 }
 
 void loop() {
-  Kaleidoscope.loop();
+  // Skipping a cycle skips every plugin's hooks, not just the scan: While slowed down,
+  // LED effects update and HostPowerManagement polls the host only every slow period.
+  if (custom::ScanGovernor::shouldScan()) {
+    Kaleidoscope.loop();
+  }
 }
\ No newline at end of file
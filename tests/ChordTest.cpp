@@ -0,0 +1,182 @@
+#include <gtest/gtest.h>
+#include <Chord.h>
+#include <IQueue.h>
+#include <FakeKeyboardBaseTest.h>
+
+// Need a named namespace for friendliness.
+namespace custom {
+
+using State = Chord::State;
+
+// Test base class with most function definitions.
+class ChordTest : public FakeKeyboardBaseTest {
+  private:
+    static EventHandlerResult iqueue_on_keyswitch(Key& mappedKey, uint8_t row, uint8_t col, uint8_t keyState) {
+      return ::IQueue.onKeyswitchEvent(mappedKey, row, col, keyState);
+    }
+
+    static EventHandlerResult iqueue_before_cycle() {
+      return ::IQueue.beforeEachCycle();
+    }
+
+    static EventHandlerResult iqueue_before_reporting() {
+      return ::IQueue.beforeReportingState();
+    }
+
+    static EventHandlerResult chord_on_keyswitch(Key& mappedKey, uint8_t row, uint8_t col, uint8_t keyState) {
+      return ::Chord.onKeyswitchEvent(mappedKey, row, col, keyState);
+    }
+
+  public:
+    void SetUp() override {
+      FakeKeyboardBaseTest::SetUp();
+      FakeKeyboardBaseTest::add_keyswitch_handler(iqueue_on_keyswitch);
+      FakeKeyboardBaseTest::add_keyswitch_handler(chord_on_keyswitch);
+      FakeKeyboardBaseTest::add_before_cycle_handler(iqueue_before_cycle);
+      FakeKeyboardBaseTest::add_before_reporting_handler(iqueue_before_reporting);
+
+      IQueue::reset();
+      Chord::reset();
+      ASSERT_EQ(Chord::setChords(chord_defs, 2), EventHandlerResult::OK);
+    }
+
+  protected:
+    static constexpr PosKey kA = PosKey { Key_A, 1, 1 };
+    static constexpr PosKey kB = PosKey { Key_B, 1, 2 };
+    static constexpr PosKey kC = PosKey { Key_C, 1, 3 };
+    static constexpr PosKey kD = PosKey { Key_D, 2, 1 };
+
+    static constexpr PosKey kX = PosKey { Key_X, kA.row, kA.col };
+    static constexpr PosKey kY = PosKey { Key_Y, kA.row, kA.col };
+
+    static const ChordDef chord_defs[2];
+
+    /// Only the two key chord, so it's complete as soon as both keys are pressed.
+    static void pair_only() {
+      ASSERT_EQ(Chord::setChords(chord_defs, 1), EventHandlerResult::OK);
+    }
+
+    static void verify_state(State s) {
+      ASSERT_EQ(Chord::state, s);
+    }
+};
+
+const ChordDef ChordTest::chord_defs[2] = {
+  { { Chord::pos(1, 1), Chord::pos(1, 2), Chord::NO_POS }, Key_X },
+  { { Chord::pos(1, 1), Chord::pos(1, 2), Chord::pos(1, 3) }, Key_Y },
+};
+
+TEST_F(ChordTest, otherKey_passesThroughImmediately) {
+  cycle({D(kD)});
+  verify({ED(kD)});
+  cycle({H(kD)});
+  verify({EH(kD)});
+  verify_state(State::IDLE);
+  ASSERT_EQ(IQueue::metrics().sessions, 0);
+}
+
+TEST_F(ChordTest, chordKey_deferred) {
+  cycle({D(kA)});
+  verify({Consumed});
+  verify_state(State::PENDING);
+}
+
+TEST_F(ChordTest, pressedTogether_noRecording) {
+  pair_only();
+  cycle({D(kA), D(kB)});
+  verify({Consumed, Consumed});
+  cycle({});
+  // The first key emits the chord key, the other one is ignored.
+  verify({ED(kX), Consumed, ReportSent});
+  verify_state(State::ACTIVE);
+  ASSERT_EQ(IQueue::metrics().cycles_recorded, 1u);
+  ASSERT_EQ(IQueue::metrics().stop_endings, 1);
+}
+
+TEST_F(ChordTest, complete_endsSession) {
+  pair_only();
+  cycle({D(kA)});
+  verify({Consumed});
+  queue_scan({H(kA), D(kB)});
+  cycle({});
+  verify({Consumed, Consumed,
+          ED(kX), ReportSent,
+          EH(kX), Consumed, ReportSent});
+  verify_state(State::ACTIVE);
+
+  cycle({H(kA), H(kB)});
+  verify({EH(kX), Consumed});
+  cycle({U(kA), H(kB)});
+  verify({EU(kX), Consumed});
+  verify_state(State::ACTIVE);
+  cycle({U(kB)});
+  verify({Consumed});
+  verify_state(State::IDLE);
+}
+
+TEST_F(ChordTest, largerChord_waitsForLastKey) {
+  cycle({D(kA)});
+  verify({Consumed});
+  queue_scan({H(kA), D(kB)});
+  queue_scan({H(kA), H(kB), D(kC)});
+  cycle({});
+  verify({Consumed, Consumed,
+          Consumed, Consumed, Consumed,
+          ED(kY), ReportSent,
+          EH(kY), Consumed, ReportSent,
+          EH(kY), Consumed, Consumed, ReportSent});
+  verify_state(State::ACTIVE);
+}
+
+TEST_F(ChordTest, timeout_usesCompleteChord) {
+  cycle({D(kA)});
+  verify({Consumed});
+  queue_scan({H(kA), D(kB)}, 100);
+  cycle({});
+  verify({Consumed, Consumed,
+          ED(kX), ReportSent,
+          EH(kX), Consumed, ReportSent});
+  verify_state(State::ACTIVE);
+  ASSERT_EQ(IQueue::metrics().deadline_endings, 1);
+}
+
+TEST_F(ChordTest, otherKey_endsSessionWithoutChord) {
+  cycle({D(kA)});
+  verify({Consumed});
+  queue_scan({H(kA), D(kD)});
+  cycle({});
+  verify({Consumed, Consumed,
+          ED(kA.noKey()), ReportSent,
+          EH(kA.noKey()), ED(kD.noKey()), ReportSent});
+  verify_state(State::IDLE);
+}
+
+TEST_F(ChordTest, release_endsSessionWithoutChord) {
+  cycle({D(kA)});
+  verify({Consumed});
+  queue_scan({U(kA)});
+  cycle({});
+  verify({Consumed,
+          ED(kA.noKey()), ReportSent,
+          EU(kA.noKey()), ReportSent});
+  verify_state(State::IDLE);
+  ASSERT_EQ(IQueue::metrics().stop_endings, 1);
+}
+
+TEST_F(ChordTest, macro_passesThrough) {
+  static const uint8_t macro[] PROGMEM = {
+    CAL_MACRO_TAP(Key_A.keyCode),
+  };
+
+  constexpr PosKey mA = PosKey { Key_A, 0xFF, 0xFF };
+
+  ASSERT_EQ(IQueue::play_macro(macro, sizeof(macro)), EventHandlerResult::OK);
+  cycle({});
+  verify({ED(mA)});
+  verify_state(State::IDLE);
+  cycle({});
+  verify({EU(mA)});
+  verify_state(State::IDLE);
+}
+
+}
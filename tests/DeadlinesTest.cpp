@@ -0,0 +1,77 @@
+#include <gtest/gtest.h>
+#include <Deadlines.h>
+
+// Need a named namespace for friendliness.
+namespace custom {
+
+class DeadlinesTest : public ::testing::Test {
+  public:
+    void SetUp() override {
+      Deadlines::reset();
+    }
+
+  protected:
+    static constexpr DeadlineSlot kTapMod = DeadlineSlot::TAPMOD;
+    static constexpr DeadlineSlot kIQueue = DeadlineSlot::IQUEUE;
+};
+
+TEST_F(DeadlinesTest, passed_strictlyLater) {
+  ASSERT_FALSE(Deadlines::passed(100, 99));
+  ASSERT_FALSE(Deadlines::passed(100, 100));
+  ASSERT_TRUE(Deadlines::passed(100, 101));
+}
+
+TEST_F(DeadlinesTest, passed_acrossWrap) {
+  ASSERT_FALSE(Deadlines::passed(0x0010, 0xFFF0));
+  ASSERT_TRUE(Deadlines::passed(0xFFF0, 0x0010));
+  ASSERT_EQ(Deadlines::tick(0x12345678ul), 0x5678);
+}
+
+TEST_F(DeadlinesTest, unarmed_neverExpires) {
+  ASSERT_FALSE(Deadlines::armed(kTapMod));
+  ASSERT_FALSE(Deadlines::expired(kTapMod, 0x8000));
+  ASSERT_FALSE(Deadlines::anyExpired(0x8000));
+}
+
+TEST_F(DeadlinesTest, setEarlier_keepsEarliest) {
+  Deadlines::setEarlier(kTapMod, 200);
+  Deadlines::setEarlier(kTapMod, 300);
+  ASSERT_FALSE(Deadlines::expired(kTapMod, 200));
+  ASSERT_TRUE(Deadlines::expired(kTapMod, 201));
+
+  Deadlines::setEarlier(kTapMod, 150);
+  ASSERT_TRUE(Deadlines::expired(kTapMod, 151));
+}
+
+TEST_F(DeadlinesTest, setEarlier_acrossWrap) {
+  Deadlines::setEarlier(kTapMod, 0x0010);
+  Deadlines::setEarlier(kTapMod, 0xFFF0);
+  ASSERT_FALSE(Deadlines::expired(kTapMod, 0xFFF0));
+  ASSERT_TRUE(Deadlines::expired(kTapMod, 0xFFF1));
+}
+
+TEST_F(DeadlinesTest, anyExpired_earliestOfAllSlots) {
+  Deadlines::setEarlier(kTapMod, 300);
+  Deadlines::setEarlier(kIQueue, 200);
+  ASSERT_FALSE(Deadlines::anyExpired(200));
+  ASSERT_TRUE(Deadlines::anyExpired(201));
+  ASSERT_FALSE(Deadlines::expired(kTapMod, 201));
+  ASSERT_TRUE(Deadlines::expired(kIQueue, 201));
+
+  Deadlines::clear(kIQueue);
+  ASSERT_FALSE(Deadlines::anyExpired(201));
+  ASSERT_TRUE(Deadlines::anyExpired(301));
+
+  Deadlines::clear(kTapMod);
+  ASSERT_FALSE(Deadlines::anyExpired(301));
+}
+
+TEST_F(DeadlinesTest, clear_rearmLater) {
+  Deadlines::setEarlier(kTapMod, 100);
+  Deadlines::clear(kTapMod);
+  Deadlines::setEarlier(kTapMod, 400);
+  ASSERT_FALSE(Deadlines::expired(kTapMod, 101));
+  ASSERT_TRUE(Deadlines::expired(kTapMod, 401));
+}
+
+}
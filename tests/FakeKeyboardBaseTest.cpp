@@ -9,18 +9,24 @@ ts_millis_t FakeKeyboardBaseTest::current_millis = FakeKeyboardBaseTest::INITIAL
 
 std::deque<ScanQueueEntry> FakeKeyboardBaseTest::scan_event_queue = std::deque<ScanQueueEntry>();
 std::vector<FakeKeyEventResult> FakeKeyboardBaseTest::key_events = std::vector<FakeKeyEventResult>();
+FakeReport FakeKeyboardBaseTest::current_report = FakeReport();
+std::vector<SentReport> FakeKeyboardBaseTest::report_log = std::vector<SentReport>();
 
 std::vector<PluginOnKeyswitch> FakeKeyboardBaseTest::on_keyswitch_handlers = std::vector<PluginOnKeyswitch>();
 std::vector<PluginBeforeReporting> FakeKeyboardBaseTest::before_reporting_handlers = std::vector<PluginBeforeReporting>();
 std::vector<PluginBeforeCycle> FakeKeyboardBaseTest::before_cycle_handlers = std::vector<PluginBeforeCycle>();
+std::vector<PluginAfterCycle> FakeKeyboardBaseTest::after_cycle_handlers = std::vector<PluginAfterCycle>();
 
 void FakeKeyboardBaseTest::SetUp() {
   Test::SetUp();
   current_millis = INITIAL_MILLIS;
   key_events = std::vector<FakeKeyEventResult>();
+  current_report = FakeReport();
+  report_log = std::vector<SentReport>();
   on_keyswitch_handlers = std::vector<PluginOnKeyswitch>();
   before_reporting_handlers = std::vector<PluginBeforeReporting>();
   before_cycle_handlers = std::vector<PluginBeforeCycle>();
+  after_cycle_handlers = std::vector<PluginAfterCycle>();
 }
 
 void FakeKeyboardBaseTest::add_keyswitch_handler(PluginOnKeyswitch handler) {
@@ -35,10 +41,18 @@ void FakeKeyboardBaseTest::add_before_cycle_handler(PluginBeforeCycle handler) {
   before_cycle_handlers.push_back(handler);
 }
 
+void FakeKeyboardBaseTest::add_after_cycle_handler(PluginAfterCycle handler) {
+  after_cycle_handlers.push_back(handler);
+}
+
 ts_millis_t millis_internal() {
   return FakeKeyboardBaseTest::current_millis;
 }
 
+void delay_internal(ts_millis_t amount) {
+  FakeKeyboardBaseTest::current_millis += amount;
+}
+
 void FakeKeyboardBaseTest::queue_scan(std::initializer_list<FakeKeyEvent> events, ts_millis_t millis_post_increment) {
   scan_event_queue.push_back(ScanQueueEntry {
     std::vector<FakeKeyEvent>(events),
@@ -59,10 +73,15 @@ void FakeKeyboardBaseTest::cycle(std::initializer_list<FakeKeyEvent> events, ts_
   before_reporting_internal();
   current_millis += inc;
   send_report_internal();
+  release_all_keys_internal();
+  after_cycle_internal();
 }
 
 void FakeKeyboardBaseTest::verify(std::initializer_list<FakeKeyEventResultExpectation> raw_expectations) {
-  std::vector<FakeKeyEventResultExpectation> expectations(raw_expectations);
+  verify(std::vector<FakeKeyEventResultExpectation>(raw_expectations));
+}
+
+void FakeKeyboardBaseTest::verify(std::vector<FakeKeyEventResultExpectation> expectations) {
   expectations.push_back(ReportSent);
 
   ASSERT_EQ(key_events.size(), expectations.size());
@@ -91,6 +110,46 @@ void FakeKeyboardBaseTest::inc_millis(ts_millis_t amount) {
   current_millis += amount;
 }
 
+void FakeKeyboardBaseTest::discard_events() {
+  key_events.clear();
+}
+
+std::vector<FakeReport> FakeKeyboardBaseTest::sent_reports() {
+  std::vector<FakeReport> reports;
+
+  for (auto& sent : report_log) {
+    if (reports.empty() || reports.back() != sent.keys) {
+      reports.push_back(sent.keys);
+    }
+  }
+
+  return reports;
+}
+
+std::vector<FakeReport> FakeKeyboardBaseTest::polled_reports(ts_millis_t poll_interval) {
+  std::vector<FakeReport> reports;
+  if (report_log.empty()) {
+    return reports;
+  }
+
+  auto next = report_log.begin();
+  ts_millis_t poll = report_log.front().ts / poll_interval * poll_interval;
+
+  for (; next != report_log.end(); poll += poll_interval) {
+    // Newer reports overwrite older ones, until the host polls.
+    auto latest = report_log.end();
+    for (; next != report_log.end() && next->ts <= poll; next++) {
+      latest = next;
+    }
+
+    if (latest != report_log.end() && (reports.empty() || reports.back() != latest->keys)) {
+      reports.push_back(latest->keys);
+    }
+  }
+
+  return reports;
+}
+
 void FakeKeyboardBaseTest::handle_keyswitch_internal(Key mappedKey, uint8_t row, uint8_t col, uint8_t keyState) {
   FakeKeyEvent orig = FakeKeyEvent { mappedKey, row, col, keyState };
   EventHandlerResult result = EventHandlerResult::OK;
@@ -104,6 +163,10 @@ void FakeKeyboardBaseTest::handle_keyswitch_internal(Key mappedKey, uint8_t row,
     }
   }
 
+  if (result != EventHandlerResult::EVENT_CONSUMED && keyIsPressed(keyState)) {
+    current_report.insert(std::make_pair(row, col));
+  }
+
   key_events.push_back(FakeKeyEventResult { orig, mappedKey, result, false });
 }
 
@@ -123,10 +186,24 @@ void FakeKeyboardBaseTest::before_cycle_internal() {
   }
 }
 
+void FakeKeyboardBaseTest::after_cycle_internal() {
+  for (auto& handler : after_cycle_handlers) {
+    EventHandlerResult result = handler();
+    ASSERT_TRUE(result == EventHandlerResult::OK || result == EventHandlerResult::EVENT_CONSUMED)
+                  << "Invalid event handler result: " << mys(result);
+  }
+}
+
 void FakeKeyboardBaseTest::send_report_internal() {
   FakeKeyEventResult expect = {};
   expect.is_send_report_marker = true;
   key_events.push_back(expect);
+
+  report_log.push_back(SentReport { current_millis, current_report });
+}
+
+void FakeKeyboardBaseTest::release_all_keys_internal() {
+  current_report.clear();
 }
 
 void FakeKeyboardBaseTest::act_on_matrix_scan_internal() {
@@ -143,6 +220,14 @@ extern "C" {
   ts_millis_t millis() {
     return millis_internal();
   }
+
+  ts_millis_t micros() {
+    return millis_internal() * 1000;
+  }
+
+  void delay(ts_millis_t ms) {
+    delay_internal(ms);
+  }
 }
 
 void handleKeyswitchEvent(Key mappedKey, uint8_t row, uint8_t col, uint8_t keyState) {
@@ -164,6 +249,7 @@ EventHandlerResult Hooks::beforeReportingState() {
 }
 
 EventHandlerResult Hooks::afterEachCycle() {
+  FakeKeyboardBaseTest::after_cycle_internal();
   return EventHandlerResult::OK;
 }
 
@@ -175,7 +261,9 @@ void sendKeyboardReport() {
   FakeKeyboardBaseTest::send_report_internal();
 }
 
-void releaseAllKeys() {}
+void releaseAllKeys() {
+  FakeKeyboardBaseTest::release_all_keys_internal();
+}
 
 }
 
@@ -9,6 +9,7 @@
 #include <kaleidoscope/key_defs.h>
 #include <kaleidoscope/keyswitch_state.h>
 #include <optional>
+#include <set>
 #include <utility>
 #include <vector>
 #include <Kaleidoscope-Hardware-Virtual.h>
@@ -20,9 +21,13 @@ typedef unsigned long ts_millis_t;
 typedef EventHandlerResult (*PluginOnKeyswitch)(Key& mappedKey, uint8_t row, uint8_t col, uint8_t keyState);
 typedef EventHandlerResult (*PluginBeforeReporting)();
 typedef EventHandlerResult (*PluginBeforeCycle)();
+typedef EventHandlerResult (*PluginAfterCycle)();
 
 typedef std::pair<uint8_t, uint8_t> RCPair;
 
+/// Positions of the keys pressed in a report.
+typedef std::set<RCPair> FakeReport;
+
 struct FakeKeyEvent {
   Key key;
   uint8_t row;
@@ -37,6 +42,11 @@ struct FakeKeyEventResult {
   bool is_send_report_marker;
 };
 
+struct SentReport {
+  ts_millis_t ts;
+  FakeReport keys;
+};
+
 struct ScanQueueEntry {
   std::vector<FakeKeyEvent> events;
   ts_millis_t millis_post_increment;
@@ -73,15 +83,27 @@ class FakeKeyboardBaseTest : public ::testing::Test {
     static void add_keyswitch_handler(PluginOnKeyswitch handler);
     static void add_before_reporting_handler(PluginBeforeReporting handler);
     static void add_before_cycle_handler(PluginBeforeCycle handler);
+    static void add_after_cycle_handler(PluginAfterCycle handler);
 
     static void queue_scan(std::initializer_list<FakeKeyEvent> event, ts_millis_t millis_post_increments = 10);
 
     static void cycle(std::initializer_list<FakeKeyEvent> events, ts_millis_t total_millis = 20);
 
     static void verify(std::initializer_list<FakeKeyEventResultExpectation> expectations);
+    static void verify(std::vector<FakeKeyEventResultExpectation> expectations);
 
     static void inc_millis(ts_millis_t amount);
 
+    /// Drop all recorded events without verifying them (for benchmarks).
+    static void discard_events();
+
+    /// All reports sent so far, skipping reports identical to the one before.
+    static std::vector<FakeReport> sent_reports();
+
+    /// The reports a host polling every `poll_interval` ms would have received. The
+    /// host only sees the last report sent before each poll, skipping identical ones.
+    static std::vector<FakeReport> polled_reports(ts_millis_t poll_interval);
+
     /// Down
     static FakeKeyEvent D(PosKey key) {
       return FakeKeyEvent { key.key, key.row, key.col, IS_PRESSED };
@@ -153,21 +175,28 @@ class FakeKeyboardBaseTest : public ::testing::Test {
     static ts_millis_t current_millis;
     static std::deque<ScanQueueEntry> scan_event_queue;
     static std::vector<FakeKeyEventResult> key_events;
+    static FakeReport current_report;
+    static std::vector<SentReport> report_log;
     static std::vector<PluginOnKeyswitch> on_keyswitch_handlers;
     static std::vector<PluginBeforeReporting> before_reporting_handlers;
     static std::vector<PluginBeforeCycle> before_cycle_handlers;
+    static std::vector<PluginAfterCycle> after_cycle_handlers;
 
     static void handle_keyswitch_internal(Key mappedKey, uint8_t row, uint8_t col, uint8_t keyState);
     static void before_reporting_internal();
     static void before_cycle_internal();
+    static void after_cycle_internal();
 
     static void send_report_internal();
+    static void release_all_keys_internal();
     static void act_on_matrix_scan_internal();
 
     friend class kaleidoscope::Hooks;
     friend ts_millis_t millis_internal();
+    friend void delay_internal(ts_millis_t amount);
     friend void handleKeyswitchEvent(Key mappedKey, uint8_t row, uint8_t col, uint8_t keyState);
     friend void kaleidoscope::hid::sendKeyboardReport();
+    friend void kaleidoscope::hid::releaseAllKeys();
     friend void ::Virtual::actOnMatrixScan();
 
     static std::string mys(EventHandlerResult e) {
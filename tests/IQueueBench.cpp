@@ -0,0 +1,73 @@
+#include <chrono>
+#include <cstdio>
+#include <gtest/gtest.h>
+#include <IQueue.h>
+#include <FakeKeyboardBaseTest.h>
+
+// Need a named namespace for friendliness.
+namespace custom {
+
+using QByte = IQueue::QByte;
+
+/// Host benchmark of the IQueue replay loop. Not run as part of the tests, run
+/// the `IQueueBench` binary directly to see the numbers.
+class IQueueBench : public FakeKeyboardBaseTest {
+  public:
+    void SetUp() override {
+      FakeKeyboardBaseTest::SetUp();
+      IQueue::reset();
+    }
+
+  protected:
+    static constexpr size_t ITERATIONS = 20000;
+
+    static constexpr size_t CYCLES = 32;
+
+    /// Fill the queue with one cycle pressing `held` keys, followed by cycles
+    /// without explicit updates.
+    static void fill_queue(uint8_t held) {
+      for (size_t i = 0; i < CYCLES; i++) {
+        size_t cycle_start = IQueue::queue_len;
+        size_t updates_start = cycle_start + IQueue::header_size(1) + 1;
+        IQueue::queue_len = updates_start;
+        IQueue::update_cnt = 0;
+        if (i == 0) {
+          for (uint8_t pos = 0; pos < held; pos++) {
+            IQueue::record_update(pos, IS_PRESSED);
+          }
+        }
+        IQueue::record_cycle(cycle_start, updates_start, 1);
+      }
+    }
+
+    static double bench_replay(uint8_t held) {
+      std::chrono::nanoseconds total(0);
+
+      for (size_t i = 0; i < ITERATIONS; i++) {
+        IQueue::begin_record(0);
+        fill_queue(held);
+
+        auto start = std::chrono::steady_clock::now();
+        IQueue::replay();
+        total += std::chrono::steady_clock::now() - start;
+
+        FakeKeyboardBaseTest::discard_events();
+      }
+
+      return (double)total.count() / ITERATIONS;
+    }
+
+    static void print_replay_costs() {
+      printf("%10s %12s %14s\n", "held keys", "ns / replay", "ns / cycle");
+      for (uint8_t held : { 0, 1, 2, 4, 8, 16 }) {
+        double ns = bench_replay(held);
+        printf("%10u %12.0f %14.1f\n", held, ns, ns / CYCLES);
+      }
+    }
+};
+
+TEST_F(IQueueBench, replay_costByHeldKeys) {
+  print_replay_costs();
+}
+
+}
@@ -6,12 +6,27 @@
 namespace custom {
 
 using State = IQueue::State;
-using QWord = IQueue::QWord;
+using QByte = IQueue::QByte;
 
 // Test base class with most function definitions.
 class IQueueTest : public FakeKeyboardBaseTest {
   protected:
     static bool should_start_queuing;
+    /// Join the session with a second requester, which stops on `kD`.
+    static bool should_join_queuing;
+    static millis_offset_t join_timeout;
+    /// Start a chained session when `chain_on` is replayed, which stops on `chain_until`.
+    static std::optional<PosKey> chain_on;
+    static PosKey chain_until;
+    static std::vector<ts_millis_t> skipped_cycles;
+    static bool replay_skipped_cycles;
+    /// Called for each recorded event, to rewrite the queue.
+    static void (*on_decide)(Key key, uint8_t keyState);
+
+    static bool on_skipped_cycle(ts_millis_t ts) {
+      skipped_cycles.push_back(ts);
+      return replay_skipped_cycles;
+    }
 
   private:
     static EventHandlerResult iqueue_on_keyswitch(Key& mappedKey, uint8_t row, uint8_t col, uint8_t keyState) {
@@ -22,15 +37,41 @@ class IQueueTest : public FakeKeyboardBaseTest {
       return ::IQueue.beforeEachCycle();
     }
 
+    static EventHandlerResult iqueue_before_reporting() {
+      return ::IQueue.beforeReportingState();
+    }
+
     static bool should_stop_queuing(Key key, uint8_t row, uint8_t col, uint8_t keyState) {
+      if (on_decide != nullptr) {
+        on_decide(key, keyState);
+      }
+      if (key == Key_X && keyToggledOn(keyState)) {
+        IQueue::commit_queue();
+      }
       return key == Key_Z;
     }
 
+    static bool should_stop_joined(Key key, uint8_t row, uint8_t col, uint8_t keyState) {
+      return row == kD.row && col == kD.col && keyToggledOn(keyState);
+    }
+
+    static bool should_stop_chained(Key key, uint8_t row, uint8_t col, uint8_t keyState) {
+      return row == chain_until.row && col == chain_until.col && keyToggledOn(keyState);
+    }
+
     static EventHandlerResult inject_on_keyswitch(Key& mappedKey, uint8_t row, uint8_t col, uint8_t keyState) {
       if (should_start_queuing) {
         should_start_queuing = false;
         return IQueue::start_queue(400, should_stop_queuing);
       }
+      if (should_join_queuing) {
+        should_join_queuing = false;
+        return IQueue::start_queue(join_timeout, should_stop_joined);
+      }
+      if (chain_on && row == chain_on->row && col == chain_on->col && keyToggledOn(keyState)) {
+        chain_on.reset();
+        return IQueue::start_queue(400, should_stop_chained);
+      }
 
       return EventHandlerResult::OK;
     }
@@ -40,11 +81,18 @@ class IQueueTest : public FakeKeyboardBaseTest {
       FakeKeyboardBaseTest::SetUp();
       FakeKeyboardBaseTest::add_keyswitch_handler(iqueue_on_keyswitch);
       FakeKeyboardBaseTest::add_before_cycle_handler(iqueue_before_cycle);
+      FakeKeyboardBaseTest::add_before_reporting_handler(iqueue_before_reporting);
       FakeKeyboardBaseTest::add_keyswitch_handler(inject_on_keyswitch);
 
       IQueue::reset();
 
       should_start_queuing = false;
+      should_join_queuing = false;
+      join_timeout = 400;
+      chain_on.reset();
+      skipped_cycles.clear();
+      replay_skipped_cycles = false;
+      on_decide = nullptr;
     }
 
   protected:
@@ -53,13 +101,19 @@ class IQueueTest : public FakeKeyboardBaseTest {
     static constexpr PosKey kC = PosKey { Key_C, 1, 3 };
     static constexpr PosKey kD = PosKey { Key_D, 1, 4 };
     static constexpr PosKey kStop = PosKey { Key_Z, 2, 1 };
+    static constexpr PosKey kCommit = PosKey { Key_X, 2, 3 };
+
+    static constexpr uint8_t DELTA_EXT = IQueue::DELTA_EXT;
+    static constexpr uint8_t COUNT_EXT = IQueue::COUNT_EXT;
+    static constexpr size_t QUEUE_SIZE = IQueue::QUEUE_SIZE;
+    static constexpr size_t HEADROOM = IQueue::HEADROOM;
 
     static void verify_state(State s) {
       ASSERT_EQ(IQueue::state, s);
     }
 
-    static void verify_queue(std::initializer_list<QWord> raw_items) {
-      std::vector<QWord> items(raw_items);
+    static void verify_queue(std::initializer_list<QByte> raw_items) {
+      std::vector<QByte> items(raw_items);
       ASSERT_EQ(IQueue::queue_len, items.size());
 
       for (size_t i = 0; i < items.size(); i++) {
@@ -70,9 +124,72 @@ class IQueueTest : public FakeKeyboardBaseTest {
     static void stop_after_record() {
       IQueue::stop_after_record = true;
     }
+
+    /// Record a cycle without any explicit updates, as if it was scanned.
+    static void record_empty_cycle(millis_offset_t delta) {
+      size_t cycle_start = IQueue::queue_len;
+      size_t updates_start = cycle_start + IQueue::header_size(delta) + 1;
+      IQueue::queue_len = updates_start;
+      IQueue::update_cnt = 0;
+      IQueue::record_cycle(cycle_start, updates_start, delta);
+    }
+
+    static void verify_scans(uint16_t scans) {
+      ASSERT_EQ(IQueue::session_scans, scans);
+    }
+
+    static void set_scan_interval(uint8_t interval_ms) {
+      IQueue::setScanInterval(interval_ms);
+    }
+
+    static void record_cooperative() {
+      IQueue::setRecordMode(IQueue::RecordMode::COOPERATIVE);
+    }
+
+    static void replay_paced(uint8_t interval_ms) {
+      IQueue::setReplayMode(IQueue::ReplayMode::PACED);
+      IQueue::setReplayInterval(interval_ms);
+    }
+
+    static FakeReport report(std::initializer_list<PosKey> keys) {
+      FakeReport r;
+      for (auto& k : keys) { r.insert(std::make_pair(k.row, k.col)); }
+      return r;
+    }
+
+    static void coalesce_replay(bool notify) {
+      IQueue::setCoalesceReplay(true);
+      if (notify) {
+        IQueue::setOnSkippedCycle(on_skipped_cycle);
+      }
+    }
+
+    static void verify_flushes(uint16_t early_flushes) {
+      ASSERT_EQ(IQueue::early_flush_count(), early_flushes);
+    }
+
+    /// Encode a single update for `pos_idx`, and decode it again.
+    static void verify_update_encoding(uint16_t pos_idx, std::initializer_list<QByte> bytes) {
+      IQueue::queue_len = 0;
+      IQueue::record_update(pos_idx, IS_PRESSED);
+      verify_queue(bytes);
+      ASSERT_EQ(IQueue::update_size(IQueue::queue[0]), bytes.size());
+      ASSERT_EQ(IQueue::update_pos_idx(0), pos_idx);
+    }
+
+    static void replay_queue() {
+      IQueue::replay();
+    }
 };
 
 bool IQueueTest::should_start_queuing = false;
+bool IQueueTest::should_join_queuing = false;
+millis_offset_t IQueueTest::join_timeout = 400;
+std::optional<PosKey> IQueueTest::chain_on = std::nullopt;
+PosKey IQueueTest::chain_until = PosKey { Key_NoKey, 0, 0 };
+std::vector<ts_millis_t> IQueueTest::skipped_cycles = std::vector<ts_millis_t>();
+bool IQueueTest::replay_skipped_cycles = false;
+void (*IQueueTest::on_decide)(Key key, uint8_t keyState) = nullptr;
 
 TEST_F(IQueueTest, idle_passesThrough) {
   cycle({});
@@ -109,15 +226,73 @@ TEST_F(IQueueTest, recordStuff) {
           Consumed, Consumed, Consumed, Consumed});
   verify_state(State::RECORD);
   verify_queue({
-    { .millis_offset = 0 },
-      { .pos_idx = kA.pos(), .is_last_update = false, .key_state = IS_PRESSED },
-      { .pos_idx = kB.pos(), .is_last_update = false, .key_state = WAS_PRESSED },
-      { .pos_idx = kC.pos(), .is_last_update = true, .key_state = IS_PRESSED | WAS_PRESSED },
-    { .millis_offset = 10, .no_explicit_updates = true },
-    { .millis_offset = 30 },
-      { .pos_idx = kA.pos(), .is_last_update = false, .key_state = WAS_PRESSED },
-      { .pos_idx = kB.pos(), .is_last_update = false, .key_state = IS_PRESSED },
-      { .pos_idx = kStop.pos(), .is_last_update = true, .key_state = IS_PRESSED }});
+    { .delta = 0, .count = 2, .is_run = false },
+      { .pos_idx = kA.pos(), .key_state = IS_PRESSED },
+      { .pos_idx = kB.pos(), .key_state = WAS_PRESSED },
+      { .pos_idx = kC.pos(), .key_state = IS_PRESSED | WAS_PRESSED },
+    { .delta = 10, .count = 0, .is_run = true },
+    { .delta = 20, .count = 2, .is_run = false },
+      { .pos_idx = kA.pos(), .key_state = WAS_PRESSED },
+      { .pos_idx = kB.pos(), .key_state = IS_PRESSED },
+      { .pos_idx = kStop.pos(), .key_state = IS_PRESSED }});
+}
+
+TEST_F(IQueueTest, recordLongDeltaAndManyUpdates) {
+  should_start_queuing = true;
+  stop_after_record();
+  cycle({U(kA)}); // Need a dummy event to trigger queuing.
+  verify({EU(Key_A)});
+  // Four updates need an explicit count, then wait for 200ms.
+  queue_scan({D(kA), D(kB), D(kC), D(kD)}, 200);
+  // Long delta. [=> 200 - 31 = 169 = 0x29 + 1 * 0x80]
+  queue_scan({U(kA), H(kB), H(kC), H(kD), D(kStop)});
+  cycle({});
+  verify({Consumed, Consumed, Consumed, Consumed,
+          Consumed, Consumed, Consumed, Consumed, Consumed});
+  verify_queue({
+    { .delta = 0, .count = COUNT_EXT, .is_run = false },
+      { .raw = 4 },
+      { .pos_idx = kA.pos(), .key_state = IS_PRESSED },
+      { .pos_idx = kB.pos(), .key_state = IS_PRESSED },
+      { .pos_idx = kC.pos(), .key_state = IS_PRESSED },
+      { .pos_idx = kD.pos(), .key_state = IS_PRESSED },
+    { .delta = DELTA_EXT, .count = 1, .is_run = false },
+      { .raw = 0x29 | 0x80 }, { .raw = 0x01 },
+      { .pos_idx = kA.pos(), .key_state = WAS_PRESSED },
+      { .pos_idx = kStop.pos(), .key_state = IS_PRESSED }});
+}
+
+TEST_F(IQueueTest, recordRuns_merged) {
+  record_empty_cycle(5);
+  record_empty_cycle(5);
+  record_empty_cycle(7);
+  for (size_t i = 0; i < 5; i++) {
+    record_empty_cycle(3);
+  }
+  verify_queue({
+    { .delta = 5, .count = 1, .is_run = true },
+    { .delta = 7, .count = 0, .is_run = true },
+    { .delta = 3, .count = COUNT_EXT, .is_run = true },
+      { .raw = 5 }});
+}
+
+TEST_F(IQueueTest, encodeUpdates_sizeByPosition) {
+  // Extended updates: key state 0, then the real key state and the high part.
+  verify_update_encoding(0x3F, {{ .pos_idx = 0x3F, .key_state = IS_PRESSED }});
+  verify_update_encoding(0x40, {{ .raw = 0x20 }, { .raw = 0x40 }});
+  verify_update_encoding(0xEFF, {{ .raw = 0x2E }, { .raw = 0xFF }});
+  verify_update_encoding(0xF00, {{ .raw = 0x2F }, { .raw = 0x0F }, { .raw = 0x00 }});
+  verify_update_encoding(0xFFFF, {{ .raw = 0x2F }, { .raw = 0xFF }, { .raw = 0xFF }});
+}
+
+TEST_F(IQueueTest, replayRuns) {
+  record_empty_cycle(5);
+  record_empty_cycle(5);
+  record_empty_cycle(5);
+  record_empty_cycle(5);
+  replay_queue();
+  verify({ReportSent, ReportSent, ReportSent});
+  verify_queue({});
 }
 
 TEST_F(IQueueTest, replayStuff) {
@@ -145,4 +320,581 @@ TEST_F(IQueueTest, replayStuff) {
   verify_state(State::IDLE);
 }
 
+TEST_F(IQueueTest, earlyFlush_replaysEverything) {
+  // Every cycle takes two bytes, stop once the next one (plus headroom) won't fit.
+  const size_t cycles = (QUEUE_SIZE - 2 - HEADROOM) / 2 + 1;
+
+  should_start_queuing = true;
+  cycle({U(kA)}); // Need a dummy event to trigger queuing.
+  verify({EU(Key_A)});
+
+  std::vector<FakeKeyEventResultExpectation> expected;
+  for (size_t i = 0; i < cycles; i++) {
+    queue_scan({i % 2 == 0 ? D(kA) : U(kA)});
+    expected.push_back(Consumed);
+  }
+  for (size_t i = 0; i < cycles; i++) {
+    expected.push_back(i % 2 == 0 ? ED(kA.noKey()) : EU(kA.noKey()));
+    expected.push_back(ReportSent);
+  }
+  expected.push_back(ED(Key_D));
+
+  cycle({D(kD)});
+  verify(expected);
+  verify_state(State::IDLE);
+  verify_flushes(1);
+}
+
+TEST_F(IQueueTest, fullQueue_fitsScanTogglingManyKeys) {
+  constexpr PosKey kY = PosKey { Key_Y, 2, 2 };
+  // Fill the queue up to exactly the headroom.
+  const size_t cycles = (QUEUE_SIZE - 2 - HEADROOM) / 2;
+
+  // Held since before the session.
+  cycle({D(kB), D(kC), D(kD), D(kY)});
+  should_start_queuing = true;
+  cycle({U(kA)}); // Need a dummy event to trigger queuing.
+  discard_events();
+
+  std::vector<FakeKeyEventResultExpectation> expected;
+  for (size_t i = 0; i < cycles; i++) {
+    queue_scan({i % 2 == 0 ? D(kA) : U(kA)});
+    expected.push_back(Consumed);
+  }
+  // Many more updates than a single extended update.
+  queue_scan({U(kB), U(kC), U(kD), U(kY), D(kStop)});
+  for (size_t i = 0; i < 5; i++) {
+    expected.push_back(Consumed);
+  }
+  for (size_t i = 0; i < cycles; i++) {
+    expected.push_back(i % 2 == 0 ? ED(kA.noKey()) : EU(kA.noKey()));
+    expected.push_back(ReportSent);
+  }
+  // Every release still arrives, in position order.
+  if (cycles % 2 == 1) {
+    expected.push_back(EH(kA.noKey()));
+  }
+  expected.push_back(EU(kB));
+  expected.push_back(EU(kC));
+  expected.push_back(EU(kD));
+  expected.push_back(ED(kStop.noKey()));
+  expected.push_back(EU(kY));
+  expected.push_back(ReportSent);
+
+  cycle({});
+  verify(expected);
+  verify_state(State::IDLE);
+  verify_flushes(0);
+  ASSERT_EQ(IQueue::metrics().stop_endings, 1);
+}
+
+TEST_F(IQueueTest, fullQueue_passesOnTogglesBeyondHeadroom) {
+  // Fill the queue up to exactly the headroom.
+  const size_t cycles = (QUEUE_SIZE - 2 - HEADROOM) / 2;
+
+  should_start_queuing = true;
+  cycle({U(kA)}); // Need a dummy event to trigger queuing.
+  discard_events();
+
+  std::vector<FakeKeyEventResultExpectation> expected;
+  for (size_t i = 0; i < cycles; i++) {
+    queue_scan({i % 2 == 0 ? D(kA) : U(kA)});
+    expected.push_back(Consumed);
+  }
+  // Two more toggles than the headroom (ten one byte updates) has room for.
+  ASSERT_EQ(HEADROOM, 10u);
+  std::vector<PosKey> keys;
+  for (uint8_t col = 0; col < 11; col++) {
+    keys.push_back(PosKey { Key_Q, 3, col });
+  }
+  queue_scan({D(kStop), D(keys[0]), D(keys[1]), D(keys[2]), D(keys[3]), D(keys[4]),
+              D(keys[5]), D(keys[6]), D(keys[7]), D(keys[8]), D(keys[9]), D(keys[10])});
+  expected.push_back(Consumed);
+  for (uint8_t col = 0; col < 11; col++) {
+    expected.push_back(col < 9 ? Consumed : ED(keys[col]));
+  }
+  for (size_t i = 0; i < cycles; i++) {
+    expected.push_back(i % 2 == 0 ? ED(kA.noKey()) : EU(kA.noKey()));
+    expected.push_back(ReportSent);
+  }
+  if (cycles % 2 == 1) {
+    expected.push_back(EH(kA.noKey()));
+  }
+  expected.push_back(ED(kStop.noKey()));
+  for (uint8_t col = 0; col < 9; col++) {
+    expected.push_back(ED(keys[col].noKey()));
+  }
+  expected.push_back(ReportSent);
+
+  cycle({});
+  verify(expected);
+  verify_state(State::IDLE);
+  ASSERT_EQ(IQueue::metrics().overflows, 2);
+}
+
+TEST_F(IQueueTest, pacedRecord_scansPerInterval) {
+  should_start_queuing = true;
+  stop_after_record();
+  set_scan_interval(25);
+  cycle({U(kA)}); // Need a dummy event to trigger queuing.
+  verify({EU(Key_A)});
+  // Recording starts 20ms after the deadline base and lasts until 400ms after it,
+  // so there is room for scans at 0, 25, ..., 375ms.
+  for (size_t i = 0; i < 16; i++) {
+    queue_scan({}, 2);
+  }
+  cycle({});
+  verify({});
+  verify_scans(16);
+  verify_queue({});
+}
+
+TEST_F(IQueueTest, pacedRecord_cyclesAtScanPeriods) {
+  should_start_queuing = true;
+  stop_after_record();
+  set_scan_interval(25);
+  cycle({U(kA)}); // Need a dummy event to trigger queuing.
+  verify({EU(Key_A)});
+  queue_scan({D(kA)}, 2);
+  // [=> implicit update]
+  queue_scan({H(kA)}, 2);
+  // [=> no update]
+  queue_scan({H(kA)}, 2);
+  queue_scan({H(kA), D(kStop)}, 2);
+  cycle({});
+  verify({Consumed, Consumed, Consumed, Consumed, Consumed});
+  verify_scans(4);
+  verify_queue({
+    { .delta = 0, .count = 0, .is_run = false },
+      { .pos_idx = kA.pos(), .key_state = IS_PRESSED },
+    { .delta = 25, .count = 0, .is_run = true },
+    { .delta = DELTA_EXT, .count = 0, .is_run = false },
+      { .raw = 50 - DELTA_EXT },
+      { .pos_idx = kStop.pos(), .key_state = IS_PRESSED }});
+}
+
+TEST_F(IQueueTest, coalescedReplay_skipsCyclesWithoutUpdates) {
+  should_start_queuing = true;
+  coalesce_replay(true);
+  cycle({U(kA)}); // Need a dummy event to trigger queuing.
+  verify({EU(Key_A)});
+  queue_scan({D(kA), U(kB), H(kC)});
+  // Hold A & C. [=> implicit update, skipped during replay]
+  queue_scan({H(kA), H(kC)});
+  queue_scan({H(kA), H(kC)});
+  queue_scan({U(kA), D(kB), H(kC), D(kStop)});
+  cycle({D(kD)});
+  verify({Consumed, Consumed, Consumed,
+          Consumed, Consumed,
+          Consumed, Consumed,
+          Consumed, Consumed, Consumed, Consumed,
+          ED(kA.noKey()), EU(kB), EH(kC), ReportSent,
+          EU(kA.noKey()), ED(kB.noKey()), EH(kC), ED(kStop.noKey()), ReportSent,
+          ED(Key_D)});
+  verify_state(State::IDLE);
+  // Recording started at 125ms, the skipped cycle was 10ms later.
+  ASSERT_EQ(skipped_cycles, std::vector<ts_millis_t>({ 135 }));
+}
+
+TEST_F(IQueueTest, coalescedReplay_hookCanForceCycle) {
+  should_start_queuing = true;
+  coalesce_replay(true);
+  replay_skipped_cycles = true;
+  cycle({U(kA)}); // Need a dummy event to trigger queuing.
+  verify({EU(Key_A)});
+  queue_scan({D(kA)});
+  // [=> implicit update, replayed since the hook asks for it]
+  queue_scan({H(kA)});
+  queue_scan({H(kA), D(kStop)});
+  cycle({});
+  verify({Consumed, Consumed, Consumed, Consumed,
+          ED(kA.noKey()), ReportSent,
+          EH(kA.noKey()), ReportSent,
+          EH(kA.noKey()), ED(kStop.noKey()), ReportSent});
+  ASSERT_EQ(skipped_cycles.size(), 1u);
+}
+
+TEST_F(IQueueTest, pipelined_replaysCommittedPrefix) {
+  should_start_queuing = true;
+  cycle({U(kA)}); // Need a dummy event to trigger queuing.
+  verify({EU(Key_A)});
+  queue_scan({D(kA)});
+  // [=> commits this and the previous cycle]
+  queue_scan({H(kA), D(kCommit)});
+  queue_scan({U(kA), H(kCommit)});
+  queue_scan({H(kCommit), D(kStop)});
+  cycle({D(kD)});
+  verify({Consumed,
+          Consumed, Consumed,
+          ED(kA.noKey()), ReportSent,
+          EH(kA.noKey()), ED(kCommit.noKey()), ReportSent,
+          Consumed, Consumed,
+          Consumed, Consumed,
+          EU(kA.noKey()), EH(kCommit.noKey()), ReportSent,
+          ED(kStop.noKey()), EH(kCommit.noKey()), ReportSent,
+          ED(Key_D)});
+  verify_state(State::IDLE);
+}
+
+TEST_F(IQueueTest, cooperative_recordsOneScanPerCycle) {
+  should_start_queuing = true;
+  record_cooperative();
+  cycle({U(kA)}); // Need a dummy event to trigger queuing.
+  verify({EU(Key_A)});
+  verify_state(State::PREPARING);
+  // C was held before, so it stays in the live report.
+  cycle({D(kA), U(kB), H(kC)});
+  verify({Consumed, Consumed, EH(kC)});
+  verify_state(State::RECORD);
+  cycle({H(kA), H(kC)});
+  verify({Consumed, EH(kC)});
+  cycle({H(kA), H(kC)});
+  verify({Consumed, EH(kC)});
+  cycle({U(kA), D(kB), H(kC), D(kStop)});
+  verify({Consumed, Consumed, EH(kC), Consumed});
+  verify_state(State::RECORD);
+  // Replayed at the start of the next cycle, which then continues normally.
+  cycle({D(kD)});
+  verify({ED(kA.noKey()), EU(kB), EH(kC), ReportSent,
+          EH(kA.noKey()), EH(kC), ReportSent,
+          EU(kA.noKey()), ED(kB.noKey()), EH(kC), ED(kStop.noKey()), ReportSent,
+          ED(Key_D)});
+  verify_state(State::IDLE);
+  verify_scans(4);
+}
+
+TEST_F(IQueueTest, cooperative_deadlineEndsSession) {
+  should_start_queuing = true;
+  record_cooperative();
+  cycle({U(kA)}); // Need a dummy event to trigger queuing.
+  verify({EU(Key_A)});
+  cycle({D(kA)});
+  verify({Consumed});
+  inc_millis(400);
+  cycle({H(kA)});
+  verify({ED(kA.noKey()), ReportSent,
+          EH(Key_A)});
+  verify_state(State::IDLE);
+  verify_scans(1);
+}
+
+TEST_F(IQueueTest, metrics_countSessions) {
+  should_start_queuing = true;
+  cycle({U(kA)}); // Need a dummy event to trigger queuing.
+  queue_scan({D(kA)});
+  queue_scan({U(kA), D(kStop)});
+  cycle({});
+
+  // The second session runs into the deadline.
+  should_start_queuing = true;
+  cycle({U(kStop)});
+  queue_scan({D(kB)}, 400);
+  cycle({});
+  discard_events();
+
+  const IQueue::Metrics& metrics = IQueue::metrics();
+  ASSERT_EQ(metrics.sessions, 2);
+  ASSERT_EQ(metrics.stop_endings, 1);
+  ASSERT_EQ(metrics.deadline_endings, 1);
+  ASSERT_EQ(metrics.early_flushes, 0);
+  ASSERT_EQ(metrics.cycles_recorded, 3u);
+  ASSERT_EQ(metrics.cycles_replayed, 3u);
+  // Header and update of the first, plus header and two updates of the second cycle.
+  ASSERT_EQ(metrics.peak_queue_len, 5);
+  ASSERT_GE(metrics.max_record_ms, 400);
+
+  IQueue::resetMetrics();
+  ASSERT_EQ(IQueue::metrics().sessions, 0);
+}
+
+TEST_F(IQueueTest, sharedSession_endsWhenAllRequestersStop) {
+  should_start_queuing = true;
+  should_join_queuing = true;
+  cycle({U(kA), U(kB)}); // The first event starts, the second joins.
+  verify({EU(Key_A), EU(Key_B)});
+  // Only the first requester is satisfied. [=> keep recording]
+  queue_scan({D(kStop)});
+  queue_scan({D(kD)});
+  cycle({});
+  verify({Consumed, Consumed,
+          ED(kStop.noKey()), ReportSent,
+          ED(kD.noKey()), EH(kStop.noKey()), ReportSent});
+  verify_state(State::IDLE);
+  ASSERT_EQ(IQueue::metrics().stop_endings, 1);
+}
+
+TEST_F(IQueueTest, sharedSession_deadlineOfUndecidedRequester) {
+  should_start_queuing = true;
+  should_join_queuing = true;
+  join_timeout = 50;
+  cycle({U(kA), U(kB)});
+  verify({EU(Key_A), EU(Key_B)});
+  queue_scan({D(kStop)}, 100);
+  cycle({});
+  verify({Consumed,
+          ED(kStop.noKey()), ReportSent});
+  ASSERT_EQ(IQueue::metrics().stop_endings, 0);
+  ASSERT_EQ(IQueue::metrics().deadline_endings, 1);
+}
+
+TEST_F(IQueueTest, chainedSession_decidedByQueuedCycles) {
+  should_start_queuing = true;
+  cycle({U(kA)}); // Need a dummy event to trigger queuing.
+  verify({EU(Key_A)});
+  chain_on = kA;
+  chain_until = kC;
+  queue_scan({D(kA)});
+  queue_scan({D(kB)});
+  queue_scan({D(kC)});
+  queue_scan({D(kStop)});
+  cycle({});
+  // The chained session sees the queued cycles up to its decision, then replay
+  // continues without recording anything.
+  verify({Consumed, Consumed, Consumed, Consumed,
+          ED(kA.noKey()), ReportSent,
+          Consumed, Consumed,
+          EH(kA.noKey()), ED(kB.noKey()), ReportSent,
+          EH(kA.noKey()), EH(kB.noKey()), ED(kC.noKey()), ReportSent,
+          EH(kA.noKey()), EH(kB.noKey()), EH(kC.noKey()), ED(kStop.noKey()), ReportSent});
+  verify_state(State::IDLE);
+  ASSERT_EQ(IQueue::metrics().sessions, 2);
+  ASSERT_EQ(IQueue::metrics().cycles_recorded, 4u);
+}
+
+TEST_F(IQueueTest, chainedSession_recordsAfterQueuedCycles) {
+  should_start_queuing = true;
+  cycle({U(kA)}); // Need a dummy event to trigger queuing.
+  verify({EU(Key_A)});
+  chain_on = kA;
+  chain_until = kD;
+  queue_scan({D(kA)});
+  queue_scan({D(kB)});
+  queue_scan({D(kStop)});
+  queue_scan({D(kD)});
+  cycle({});
+  // The queued cycles don't decide the chained session, so it records the next scan.
+  verify({Consumed, Consumed, Consumed,
+          ED(kA.noKey()), ReportSent,
+          Consumed, Consumed,
+          Consumed,
+          EH(kA.noKey()), ED(kB.noKey()), ReportSent,
+          EH(kA.noKey()), EH(kB.noKey()), ED(kStop.noKey()), ReportSent,
+          EH(kA.noKey()), EH(kB.noKey()), ED(kD.noKey()), EH(kStop.noKey()), ReportSent});
+  verify_state(State::IDLE);
+  ASSERT_EQ(IQueue::metrics().sessions, 2);
+  ASSERT_EQ(IQueue::metrics().cycles_recorded, 4u);
+}
+
+TEST_F(IQueueTest, rewriteKey_replaysNewKey) {
+  should_start_queuing = true;
+  on_decide = [](Key key, uint8_t keyState) {
+    if (key == Key_Z) {
+      ASSERT_EQ(IQueue::rewrite_key(kA.row, kA.col, Key_B), EventHandlerResult::OK);
+    }
+  };
+  cycle({U(kA)}); // Need a dummy event to trigger queuing.
+  verify({EU(Key_A)});
+  queue_scan({D(kA)});
+  queue_scan({U(kA), D(kStop)});
+  cycle({});
+  verify({Consumed,
+          Consumed, Consumed,
+          ED(PosKey { Key_B, kA.row, kA.col }), ReportSent,
+          EU(PosKey { Key_B, kA.row, kA.col }), ED(kStop.noKey()), ReportSent});
+}
+
+TEST_F(IQueueTest, dropUpdate_recordedAndCurrentScan) {
+  should_start_queuing = true;
+  stop_after_record();
+  on_decide = [](Key key, uint8_t keyState) {
+    if (key == Key_Z) {
+      // The press from the first cycle, then the release from the current scan.
+      ASSERT_EQ(IQueue::drop_update(kA.row, kA.col), EventHandlerResult::OK);
+      ASSERT_EQ(IQueue::drop_update(kA.row, kA.col), EventHandlerResult::OK);
+      ASSERT_EQ(IQueue::drop_update(kA.row, kA.col), EventHandlerResult::ERROR);
+    }
+  };
+  cycle({U(kA)}); // Need a dummy event to trigger queuing.
+  verify({EU(Key_A)});
+  queue_scan({D(kA)});
+  queue_scan({D(kB)});
+  queue_scan({U(kA), U(kB), D(kStop)});
+  cycle({});
+  verify({Consumed, Consumed, Consumed, Consumed, Consumed});
+  verify_queue({
+    { .delta = 0, .count = 0, .is_run = true },
+    { .delta = 10, .count = 0, .is_run = false },
+      { .pos_idx = kB.pos(), .key_state = IS_PRESSED },
+    { .delta = 10, .count = 1, .is_run = false },
+      { .pos_idx = kB.pos(), .key_state = WAS_PRESSED },
+      { .pos_idx = kStop.pos(), .key_state = IS_PRESSED }});
+}
+
+TEST_F(IQueueTest, insertUpdate_replaysSyntheticEvents) {
+  should_start_queuing = true;
+  on_decide = [](Key key, uint8_t keyState) {
+    if (key == Key_C && keyToggledOn(keyState)) {
+      ASSERT_EQ(IQueue::insert_update(kD.row, kD.col, IS_PRESSED), EventHandlerResult::OK);
+    }
+    if (key == Key_Z) {
+      ASSERT_EQ(IQueue::insert_update(kD.row, kD.col, WAS_PRESSED), EventHandlerResult::OK);
+    }
+  };
+  cycle({U(kA)}); // Need a dummy event to trigger queuing.
+  verify({EU(Key_A)});
+  queue_scan({D(kC)});
+  queue_scan({U(kC), D(kStop)});
+  cycle({});
+  verify({Consumed,
+          Consumed, Consumed,
+          ED(kC.noKey()), ED(kD.noKey()), ReportSent,
+          EU(kC.noKey()), EU(kD.noKey()), ED(kStop.noKey()), ReportSent});
+}
+
+TEST_F(IQueueTest, pacedReplay_oneCyclePerIteration) {
+  should_start_queuing = true;
+  replay_paced(20);
+  cycle({U(kA)}); // Need a dummy event to trigger queuing.
+  verify({EU(Key_A)});
+  queue_scan({D(kA)});
+  queue_scan({U(kA)});
+  queue_scan({D(kStop)});
+  // The first cycle is replayed right away, the live scan is recorded behind.
+  cycle({U(kStop)});
+  verify({Consumed, Consumed, Consumed,
+          Consumed,
+          ED(kA.noKey())});
+  verify_state(State::DRAIN);
+  cycle({});
+  verify({EU(kA.noKey())});
+  cycle({});
+  verify({ED(kStop.noKey())});
+  cycle({});
+  verify({EU(kStop.noKey())});
+  // Caught up.
+  cycle({D(kD)});
+  verify({ED(Key_D)});
+  verify_state(State::IDLE);
+}
+
+TEST_F(IQueueTest, pacedReplay_holdsBetweenIntervals) {
+  should_start_queuing = true;
+  replay_paced(40);
+  cycle({U(kA)}); // Need a dummy event to trigger queuing.
+  verify({EU(Key_A)});
+  queue_scan({D(kA)});
+  queue_scan({D(kStop)});
+  cycle({});
+  verify({Consumed, Consumed, ED(kA.noKey())});
+  // Not due yet, repeat the last replayed state.
+  cycle({D(kB)});
+  verify({Consumed, EH(kA.noKey())});
+  cycle({});
+  verify({EH(kA.noKey()), ED(kStop.noKey())});
+  cycle({});
+  verify({EH(kA.noKey()), EH(kStop.noKey())});
+  cycle({});
+  verify({EH(kA.noKey()), ED(kB.noKey()), EH(kStop.noKey())});
+  // Caught up, the scan is live again.
+  cycle({U(kA), U(kB), U(kStop)});
+  verify({EU(Key_A), EU(Key_B), EU(Key_Z)});
+  verify_state(State::IDLE);
+}
+
+TEST_F(IQueueTest, hostModel_immediateReplayLosesReports) {
+  should_start_queuing = true;
+  cycle({U(kA)}); // Need a dummy event to trigger queuing.
+  queue_scan({D(kA)}, 1);
+  queue_scan({U(kA), D(kB)}, 1);
+  queue_scan({U(kB), D(kStop)}, 1);
+  cycle({});
+  discard_events();
+  std::vector<FakeReport> expected = {report({}), report({kA}), report({kB}), report({kStop}), report({})};
+  ASSERT_EQ(sent_reports(), expected);
+  // All replayed reports are sent before the host polls again.
+  std::vector<FakeReport> polled = {report({}), report({kStop}), report({})};
+  ASSERT_EQ(polled_reports(1), polled);
+}
+
+TEST_F(IQueueTest, hostModel_pacedReplayLosesNothing) {
+  should_start_queuing = true;
+  replay_paced(1);
+  cycle({U(kA)}); // Need a dummy event to trigger queuing.
+  queue_scan({D(kA)}, 1);
+  queue_scan({U(kA), D(kB)}, 1);
+  queue_scan({U(kB), D(kStop)}, 1);
+  for (int i = 0; i < 4; i++) { cycle({}, 4); }
+  verify_state(State::IDLE);
+  discard_events();
+  std::vector<FakeReport> expected = {report({}), report({kA}), report({kB}), report({kStop}), report({})};
+  ASSERT_EQ(sent_reports(), expected);
+  ASSERT_EQ(polled_reports(1), expected);
+}
+
+TEST_F(IQueueTest, macro_playsOneCyclePerIteration) {
+  static const uint8_t macro[] PROGMEM = {
+    CAL_MACRO_TAP(Key_A.keyCode),
+    CAL_MACRO_PRESS_EXT(Key_LeftShift.keyCode),
+    CAL_MACRO_TAP(Key_B.keyCode),
+    CAL_MACRO_RELEASE_EXT(Key_LeftShift.keyCode),
+  };
+  // Two bytes per event, three for the modifier.
+  ASSERT_EQ(sizeof(macro), 4 * 2 + 2 * 3);
+
+  constexpr PosKey mA = PosKey { Key_A, 0xFF, 0xFF };
+  constexpr PosKey mB = PosKey { Key_B, 0xFF, 0xFF };
+  constexpr PosKey mShift = PosKey { Key_LeftShift, 0xFF, 0xFF };
+
+  ASSERT_EQ(IQueue::play_macro(macro, sizeof(macro)), EventHandlerResult::OK);
+  cycle({});
+  verify({ED(mA)});
+  cycle({D(kC)});
+  verify({ED(kC), EU(mA)});
+  cycle({});
+  verify({ED(mShift)});
+  cycle({});
+  verify({EH(mShift), ED(mB)});
+  cycle({});
+  verify({EH(mShift), EU(mB)});
+  cycle({});
+  verify({EU(mShift)});
+  cycle({});
+  verify({});
+  verify_state(State::IDLE);
+}
+
+TEST_F(IQueueTest, macro_waitsForDeltaAndReplayInterval) {
+  static const uint8_t macro[] PROGMEM = {
+    CAL_MACRO_PRESS(Key_A.keyCode),
+    CAL_MACRO_WAIT(25),
+    CAL_MACRO_RELEASE(Key_A.keyCode),
+    CAL_MACRO_TAP(Key_B.keyCode),
+  };
+
+  constexpr PosKey mA = PosKey { Key_A, 0xFF, 0xFF };
+  constexpr PosKey mB = PosKey { Key_B, 0xFF, 0xFF };
+
+  cycle({});
+  verify({});
+  ASSERT_EQ(IQueue::play_macro(macro, sizeof(macro)), EventHandlerResult::OK);
+  IQueue::setReplayInterval(30);
+  // One report per replay interval at most, counting from the last live one.
+  cycle({});
+  verify({});
+  cycle({});
+  verify({ED(mA)});
+  // The wait is shorter than the interval.
+  cycle({});
+  verify({EH(mA)});
+  cycle({});
+  verify({EU(mA)});
+  cycle({});
+  verify({});
+  cycle({});
+  verify({ED(mB)});
+
+  // Started macros can't be interrupted by a session.
+  ASSERT_EQ(IQueue::start_queue(400, nullptr), EventHandlerResult::ERROR);
+}
+
 }
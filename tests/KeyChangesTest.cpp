@@ -0,0 +1,200 @@
+#include <gtest/gtest.h>
+#include <KeyChanges.h>
+#include <TapMod.h>
+#include <FakeKeyboardBaseTest.h>
+
+// Need a named namespace for friendliness.
+namespace custom {
+
+// Test base class with most function definitions.
+class KeyChangesTest : public FakeKeyboardBaseTest {
+  private:
+    static EventHandlerResult key_changes_on_keyswitch(Key& mappedKey, uint8_t row, uint8_t col, uint8_t keyState) {
+      return ::KeyChanges.onKeyswitchEvent(mappedKey, row, col, keyState);
+    }
+
+  public:
+    void SetUp() override {
+      FakeKeyboardBaseTest::SetUp();
+      FakeKeyboardBaseTest::add_keyswitch_handler(key_changes_on_keyswitch);
+
+      KeyChanges::reset();
+      delivered.clear();
+      result = EventHandlerResult::OK;
+      rewrite_to = std::nullopt;
+      ASSERT_EQ(KeyChanges::subscribe(record), EventHandlerResult::OK);
+    }
+
+  protected:
+    static constexpr PosKey kA = PosKey { Key_A, 1, 1 };
+    static constexpr PosKey kB = PosKey { Key_B, 1, 2 };
+    static constexpr PosKey kX = PosKey { Key_X, kA.row, kA.col };
+
+    /// Key states delivered to the subscriber.
+    static std::vector<uint8_t> delivered;
+    /// What the subscriber returns.
+    static EventHandlerResult result;
+    /// What the subscriber rewrites keys to.
+    static std::optional<Key> rewrite_to;
+
+    static EventHandlerResult record(Key& mappedKey, uint8_t row, uint8_t col, uint8_t keyState) {
+      delivered.push_back(keyState);
+      if (rewrite_to) {
+        mappedKey = *rewrite_to;
+      }
+      return result;
+    }
+
+    static void verify_delivered(std::vector<uint8_t> expected) {
+      ASSERT_EQ(delivered, expected);
+      delivered.clear();
+    }
+};
+
+std::vector<uint8_t> KeyChangesTest::delivered;
+EventHandlerResult KeyChangesTest::result = EventHandlerResult::OK;
+std::optional<Key> KeyChangesTest::rewrite_to;
+
+TEST_F(KeyChangesTest, onlyChangesDelivered) {
+  cycle({D(kA)});
+  cycle({H(kA), D(kB)});
+  cycle({H(kA), H(kB)});
+  cycle({U(kA), H(kB)});
+  verify({ED(kA), ReportSent, EH(kA), ED(kB), ReportSent, EH(kA), EH(kB), ReportSent, EU(kA), EH(kB)});
+  verify_delivered({IS_PRESSED, IS_PRESSED, WAS_PRESSED});
+}
+
+TEST_F(KeyChangesTest, isHeld) {
+  ASSERT_FALSE(KeyChanges::isHeld(kA.row, kA.col));
+  cycle({D(kA)});
+  ASSERT_TRUE(KeyChanges::isHeld(kA.row, kA.col));
+  cycle({H(kA)});
+  ASSERT_TRUE(KeyChanges::isHeld(kA.row, kA.col));
+  ASSERT_FALSE(KeyChanges::isHeld(kB.row, kB.col));
+  cycle({U(kA)});
+  ASSERT_FALSE(KeyChanges::isHeld(kA.row, kA.col));
+}
+
+TEST_F(KeyChangesTest, consumedPress_holdsConsumed) {
+  result = EventHandlerResult::EVENT_CONSUMED;
+  cycle({D(kA)});
+  cycle({H(kA)});
+  cycle({H(kA)});
+  verify({Consumed, ReportSent, Consumed, ReportSent, Consumed});
+  verify_delivered({IS_PRESSED});
+}
+
+TEST_F(KeyChangesTest, rewrittenPress_holdsRewritten) {
+  rewrite_to = Key_X;
+  cycle({D(kA)});
+  rewrite_to = std::nullopt;
+  cycle({H(kA)});
+  cycle({U(kA)});
+  verify({ED(kX), ReportSent, EH(kX), ReportSent, EU(kA)});
+  verify_delivered({IS_PRESSED, WAS_PRESSED});
+}
+
+TEST_F(KeyChangesTest, forget_deliversNextHold) {
+  result = EventHandlerResult::EVENT_CONSUMED;
+  cycle({D(kA)});
+  result = EventHandlerResult::OK;
+  cycle({H(kA)});
+  verify({Consumed, ReportSent, Consumed});
+
+  KeyChanges::forget(kA.row, kA.col);
+  cycle({H(kA)});
+  cycle({H(kA)});
+  verify({EH(kA), ReportSent, EH(kA)});
+  verify_delivered({IS_PRESSED, IS_PRESSED | WAS_PRESSED});
+}
+
+class KeyChangesTapModTest : public FakeKeyboardBaseTest {
+  private:
+    static EventHandlerResult key_changes_on_keyswitch(Key& mappedKey, uint8_t row, uint8_t col, uint8_t keyState) {
+      return ::KeyChanges.onKeyswitchEvent(mappedKey, row, col, keyState);
+    }
+
+    static EventHandlerResult tap_mod_on_keyswitch(Key& mappedKey, uint8_t row, uint8_t col, uint8_t keyState) {
+      return ::TapMod.onKeyswitchEvent(mappedKey, row, col, keyState);
+    }
+
+    static EventHandlerResult tap_mod_before_reporting() {
+      return ::TapMod.beforeReportingState();
+    }
+
+    static EventHandlerResult tap_mod_before_cycle() {
+      return ::TapMod.beforeEachCycle();
+    }
+
+  public:
+    void SetUp() override {
+      FakeKeyboardBaseTest::SetUp();
+      FakeKeyboardBaseTest::add_keyswitch_handler(key_changes_on_keyswitch);
+      FakeKeyboardBaseTest::add_keyswitch_handler(tap_mod_on_keyswitch);
+      FakeKeyboardBaseTest::add_before_reporting_handler(tap_mod_before_reporting);
+      FakeKeyboardBaseTest::add_before_cycle_handler(tap_mod_before_cycle);
+
+      KeyChanges::reset();
+      TapMod::reset();
+      TapMod::setActual(0, Key_E);
+      ASSERT_EQ(TapMod::useKeyChanges(), EventHandlerResult::OK);
+    }
+
+  protected:
+    static constexpr PosKey tm1 = PosKey { Key_TapMod01, 1, 1 };
+    static constexpr PosKey kn1 = PosKey { Key_C, 2, 1 };
+    static constexpr PosKey kn2 = PosKey { Key_D, 2, 2 };
+    static constexpr PosKey kn3 = PosKey { Key_F, 3, 1 };
+
+    static FakeReport report(std::initializer_list<PosKey> keys) {
+      FakeReport r;
+      for (auto& k : keys) { r.insert(std::make_pair(k.row, k.col)); }
+      return r;
+    }
+};
+
+// Same as TapModTest.queuing_tmKeyReleased_replaysWithoutActual.
+TEST_F(KeyChangesTapModTest, queuing_tmKeyReleased_replaysWithoutActual) {
+  cycle({D(tm1)});
+  cycle({H(tm1), D(kn1)});
+  cycle({H(tm1), H(kn1), D(kn2)});
+  verify({ED(Key_E), ReportSent, EH(Key_E), ED(Key_C), ReportSent,
+          EH(Key_E), EH(Key_C), Consumed});
+  cycle({H(tm1), H(kn1), H(kn2)});
+  verify({EH(Key_E), EH(Key_C), Consumed});
+  cycle({U(tm1), H(kn1), H(kn2)});
+  verify({EU(Key_E), EH(Key_C), Consumed, ED(kn2.noKey())});
+  cycle({H(kn1), H(kn2)});
+  verify({EH(Key_C), EH(Key_D)});
+}
+
+// Same as TapModTest.pressedDelayed_accectsNextReal.
+TEST_F(KeyChangesTapModTest, pressedDelayed_acceptsNextReal) {
+  cycle({D(tm1)});
+  verify({ED(Key_E)});
+  cycle({U(tm1)});
+  verify({Consumed, EH(Key_E)});
+  cycle({D(kn1)});
+  cycle({U(kn1)});
+  verify({ED(Key_C), EH(Key_E), ReportSent, EU(Key_E), ReportSent, EU(Key_C)});
+}
+
+TEST_F(KeyChangesTapModTest, queuing_timeout_keepsHeldKeysInReplayedReports) {
+  cycle({D(tm1)});
+  cycle({H(tm1), D(kn1)});
+  cycle({H(tm1), H(kn1), D(kn2)});
+  cycle({H(tm1), H(kn1), H(kn2), D(kn3)});
+  inc_millis(200);
+  cycle({H(tm1), H(kn1), H(kn2), H(kn3)});
+  cycle({H(tm1), H(kn1), H(kn2), H(kn3)});
+  discard_events();
+
+  // The held keys don't reach TapMod, but stay in the report between the two replayed
+  // presses and after them.
+  std::vector<FakeReport> expected {
+    report({tm1}), report({tm1, kn1}), report({tm1, kn1, kn2}), report({tm1, kn1, kn2, kn3})
+  };
+  ASSERT_EQ(sent_reports(), expected);
+}
+
+}
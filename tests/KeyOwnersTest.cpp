@@ -0,0 +1,92 @@
+#include <gtest/gtest.h>
+#include <KeyOwners.h>
+#include <TapMod.h>
+#include <FakeKeyboardBaseTest.h>
+#include <timnn_keymap.h>
+
+// Need a named namespace for friendliness.
+namespace custom {
+
+// Checks the map built from the keymap of the `timnn` sketch.
+class KeyOwnersTest : public FakeKeyboardBaseTest {
+  private:
+    static EventHandlerResult tap_mod_on_keyswitch(Key& mappedKey, uint8_t row, uint8_t col, uint8_t keyState) {
+      return ::TapMod.onKeyswitchEvent(mappedKey, row, col, keyState);
+    }
+
+    static EventHandlerResult tap_mod_before_reporting() {
+      return ::TapMod.beforeReportingState();
+    }
+
+    static EventHandlerResult tap_mod_before_cycle() {
+      return ::TapMod.beforeEachCycle();
+    }
+
+  public:
+    void SetUp() override {
+      FakeKeyboardBaseTest::SetUp();
+      FakeKeyboardBaseTest::add_keyswitch_handler(tap_mod_on_keyswitch);
+      FakeKeyboardBaseTest::add_before_reporting_handler(tap_mod_before_reporting);
+      FakeKeyboardBaseTest::add_before_cycle_handler(tap_mod_before_cycle);
+
+      TapMod::reset();
+      TapMod::setActual(0, Key_E);
+    }
+
+  protected:
+    static constexpr uint8_t LAYER_CNT = sizeof(key_owners::keymap) / sizeof(*key_owners::keymap);
+
+    /// Key_TapMod01, on the left thumb.
+    static constexpr PosKey tm1 = PosKey { Key_TapMod01, 1, 7 };
+    /// Key_A, which is never a TapMod key.
+    static constexpr PosKey tm1AtA = PosKey { Key_TapMod01, 2, 1 };
+
+    static bool tap_mod_on_any_layer(uint8_t row, uint8_t col) {
+      for (uint8_t layer = 0; layer < LAYER_CNT; layer++) {
+        if (TapMod::isTapModKey(Key(key_owners::keymap[layer][row][col].raw))) {
+          return true;
+        }
+      }
+      return false;
+    }
+};
+
+TEST_F(KeyOwnersTest, map_matchesKeymap) {
+  for (uint8_t row = 0; row < ROWS; row++) {
+    for (uint8_t col = 0; col < COLS; col++) {
+      ASSERT_EQ(KeyOwners::mayOwn(KeyOwner::TAPMOD, row, col), tap_mod_on_any_layer(row, col))
+          << "row " << (int)row << ", col " << (int)col;
+    }
+  }
+}
+
+TEST_F(KeyOwnersTest, map_hasThumbKeys) {
+  size_t owned = 0;
+  for (uint16_t pos = 0; pos < KeyOwners::POS_CNT; pos++) {
+    owned += KeyOwners::owned(key_owners::map, KeyOwner::TAPMOD, pos);
+  }
+  ASSERT_EQ(owned, 4u);
+
+  ASSERT_TRUE(KeyOwners::mayOwn(KeyOwner::TAPMOD, 1, 7));
+  ASSERT_TRUE(KeyOwners::mayOwn(KeyOwner::TAPMOD, 3, 6));
+  ASSERT_TRUE(KeyOwners::mayOwn(KeyOwner::TAPMOD, 2, 8));
+  ASSERT_TRUE(KeyOwners::mayOwn(KeyOwner::TAPMOD, 3, 9));
+}
+
+TEST_F(KeyOwnersTest, outsideMatrix_mayOwn) {
+  ASSERT_TRUE(KeyOwners::mayOwn(KeyOwner::TAPMOD, 255, 255));
+}
+
+TEST_F(KeyOwnersTest, ownedPosition_handled) {
+  cycle({D(tm1)});
+  verify({ED(Key_E)});
+}
+
+TEST_F(KeyOwnersTest, otherPosition_ignored) {
+  cycle({D(tm1AtA)});
+  verify({ED(tm1AtA)});
+  cycle({U(tm1AtA)});
+  verify({EU(tm1AtA)});
+}
+
+}
@@ -0,0 +1,179 @@
+#include <gtest/gtest.h>
+#include <IQueue.h>
+#include <ReportGate.h>
+#include <FakeKeyboardBaseTest.h>
+
+// Need a named namespace for friendliness.
+namespace custom {
+
+class ReportGateTest : public FakeKeyboardBaseTest {
+  protected:
+    static bool should_start_queuing;
+    /// Send a report mid-cycle, before the loop's report.
+    static bool send_mid_cycle;
+    /// Then clear the report, and send it again.
+    static bool release_mid_cycle;
+
+  private:
+    static EventHandlerResult iqueue_on_keyswitch(Key& mappedKey, uint8_t row, uint8_t col, uint8_t keyState) {
+      return ::IQueue.onKeyswitchEvent(mappedKey, row, col, keyState);
+    }
+
+    static EventHandlerResult iqueue_before_cycle() {
+      return ::IQueue.beforeEachCycle();
+    }
+
+    static EventHandlerResult iqueue_before_reporting() {
+      return ::IQueue.beforeReportingState();
+    }
+
+    static EventHandlerResult gate_on_keyswitch(Key& mappedKey, uint8_t row, uint8_t col, uint8_t keyState) {
+      return ::ReportGate.onKeyswitchEvent(mappedKey, row, col, keyState);
+    }
+
+    static EventHandlerResult gate_after_cycle() {
+      return ::ReportGate.afterEachCycle();
+    }
+
+    static bool should_stop_queuing(Key key, uint8_t row, uint8_t col, uint8_t keyState) {
+      return key == Key_Z;
+    }
+
+    static EventHandlerResult inject_on_keyswitch(Key& mappedKey, uint8_t row, uint8_t col, uint8_t keyState) {
+      if (should_start_queuing) {
+        should_start_queuing = false;
+        return IQueue::start_queue(400, should_stop_queuing);
+      }
+      return EventHandlerResult::OK;
+    }
+
+    static EventHandlerResult inject_before_reporting() {
+      if (send_mid_cycle) {
+        ReportGate::send();
+        if (release_mid_cycle) {
+          ReportGate::releaseAllKeys();
+          ReportGate::send();
+        }
+      }
+      return EventHandlerResult::OK;
+    }
+
+  public:
+    void SetUp() override {
+      FakeKeyboardBaseTest::SetUp();
+      FakeKeyboardBaseTest::add_keyswitch_handler(iqueue_on_keyswitch);
+      FakeKeyboardBaseTest::add_before_cycle_handler(iqueue_before_cycle);
+      FakeKeyboardBaseTest::add_before_reporting_handler(iqueue_before_reporting);
+      FakeKeyboardBaseTest::add_keyswitch_handler(inject_on_keyswitch);
+      FakeKeyboardBaseTest::add_before_reporting_handler(inject_before_reporting);
+      // Last, so it sees the events as they end up in the report.
+      FakeKeyboardBaseTest::add_keyswitch_handler(gate_on_keyswitch);
+      FakeKeyboardBaseTest::add_after_cycle_handler(gate_after_cycle);
+
+      IQueue::reset();
+      ReportGate::reset();
+
+      should_start_queuing = false;
+      send_mid_cycle = false;
+      release_mid_cycle = false;
+    }
+
+  protected:
+    static constexpr PosKey kA = PosKey { Key_A, 1, 1 };
+    static constexpr PosKey kB = PosKey { Key_B, 1, 2 };
+    static constexpr PosKey kStop = PosKey { Key_Z, 2, 1 };
+
+    static FakeReport report(std::initializer_list<PosKey> keys) {
+      FakeReport r;
+      for (auto& k : keys) { r.insert(std::make_pair(k.row, k.col)); }
+      return r;
+    }
+};
+
+bool ReportGateTest::should_start_queuing;
+bool ReportGateTest::send_mid_cycle;
+bool ReportGateTest::release_mid_cycle;
+
+TEST_F(ReportGateTest, beforeFirstCycle_notCounted) {
+  ReportGate::send();
+  ReportGate::send();
+  verify({ReportSent});
+  ASSERT_EQ(ReportGate::metrics().suppressed, 0u);
+  ASSERT_EQ(ReportGate::metrics().sent, 0u);
+}
+
+TEST_F(ReportGateTest, sameKeys_countedAsSuppressed) {
+  cycle({D(kA)});
+  send_mid_cycle = true;
+  cycle({H(kA)});
+  // Left to KeyboardioHID to skip.
+  verify({ED(kA), ReportSent, EH(kA), ReportSent});
+  ASSERT_EQ(ReportGate::metrics().suppressed, 1u);
+  ASSERT_EQ(ReportGate::metrics().sent, 1u);
+}
+
+TEST_F(ReportGateTest, otherKeys_sent) {
+  cycle({D(kA)});
+  send_mid_cycle = true;
+  cycle({H(kA), D(kB)});
+  verify({ED(kA), ReportSent, EH(kA), ED(kB), ReportSent});
+  ASSERT_EQ(ReportGate::metrics().suppressed, 0u);
+}
+
+TEST_F(ReportGateTest, sameKeyElsewhere_sent) {
+  constexpr PosKey kA2 = PosKey { Key_A, 1, 3 };
+  cycle({D(kA)});
+  send_mid_cycle = true;
+  cycle({U(kA), D(kA2)});
+  verify({ED(kA), ReportSent, EU(kA), ED(kA2), ReportSent});
+  ASSERT_EQ(ReportGate::metrics().suppressed, 0u);
+}
+
+TEST_F(ReportGateTest, releasedKeys_sent) {
+  cycle({D(kA), D(kB)});
+  send_mid_cycle = true;
+  release_mid_cycle = true;
+  cycle({H(kA), H(kB)});
+  // The first mid-cycle report is unchanged, the cleared one is not.
+  verify({ED(kA), ED(kB), ReportSent, EH(kA), EH(kB), ReportSent, ReportSent});
+  ASSERT_EQ(ReportGate::metrics().suppressed, 1u);
+}
+
+TEST_F(ReportGateTest, minInterval_immediateReplayNotDelayed) {
+  // Same as IQueueTest.hostModel_immediateReplayLosesReports.
+  ReportGate::setMinInterval(1);
+  cycle({});
+  should_start_queuing = true;
+  cycle({U(kA)}); // Need a dummy event to trigger queuing.
+  queue_scan({D(kA)}, 1);
+  queue_scan({U(kA), D(kB)}, 1);
+  queue_scan({U(kB), D(kStop)}, 1);
+  cycle({});
+  discard_events();
+  std::vector<FakeReport> expected = {report({}), report({kA}), report({kB}), report({kStop}), report({})};
+  ASSERT_EQ(sent_reports(), expected);
+  // Nothing waits, the early reports are only counted.
+  std::vector<FakeReport> polled = {report({}), report({kStop}), report({})};
+  ASSERT_EQ(polled_reports(1), polled);
+  ASSERT_EQ(ReportGate::metrics().early, 2u);
+}
+
+TEST_F(ReportGateTest, minInterval_pacedReplayLosesNothing) {
+  ReportGate::setMinInterval(1);
+  IQueue::setReplayMode(IQueue::ReplayMode::PACED);
+  IQueue::setReplayInterval(1);
+  cycle({});
+  should_start_queuing = true;
+  cycle({U(kA)}); // Need a dummy event to trigger queuing.
+  queue_scan({D(kA)}, 1);
+  queue_scan({U(kA), D(kB)}, 1);
+  queue_scan({U(kB), D(kStop)}, 1);
+  for (int i = 0; i < 4; i++) { cycle({}, 4); }
+  discard_events();
+  std::vector<FakeReport> expected = {report({}), report({kA}), report({kB}), report({kStop}), report({})};
+  ASSERT_EQ(sent_reports(), expected);
+  ASSERT_EQ(polled_reports(1), expected);
+  ASSERT_EQ(ReportGate::metrics().early, 0u);
+}
+
+}
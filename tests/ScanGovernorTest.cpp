@@ -0,0 +1,107 @@
+#include <gtest/gtest.h>
+#include <ScanGovernor.h>
+#include <FakeKeyboardBaseTest.h>
+
+// Need a named namespace for friendliness.
+namespace custom {
+
+using Rate = ScanGovernor::Rate;
+
+class ScanGovernorTest : public FakeKeyboardBaseTest {
+  private:
+    static EventHandlerResult governor_on_keyswitch(Key& mappedKey, uint8_t row, uint8_t col, uint8_t keyState) {
+      return ::ScanGovernor.onKeyswitchEvent(mappedKey, row, col, keyState);
+    }
+
+  public:
+    void SetUp() override {
+      FakeKeyboardBaseTest::SetUp();
+      FakeKeyboardBaseTest::add_keyswitch_handler(governor_on_keyswitch);
+
+      ScanGovernor::reset();
+      ScanGovernor::setIdleTimeout(100);
+      ScanGovernor::setSlowPeriod(16);
+    }
+
+  protected:
+    static constexpr PosKey kA = PosKey { Key_A, 1, 1 };
+
+    /// Run `loop()` until it scans, then run the (4 ms) cycle with `events`. Returns when
+    /// the scan started.
+    static ts_millis_t scan(std::initializer_list<FakeKeyEvent> events) {
+      while (!ScanGovernor::shouldScan()) {
+        inc_millis(1);
+      }
+      ts_millis_t start = millis();
+      cycle(events, 4);
+      discard_events();
+      return start;
+    }
+
+    /// Scan without key events until `until`, returns when each scan started.
+    static std::vector<ts_millis_t> scan_until(ts_millis_t until) {
+      std::vector<ts_millis_t> starts;
+      while (millis() < until) {
+        starts.push_back(scan({}));
+      }
+      return starts;
+    }
+
+    /// Returns when the first scan at `rate` started.
+    static ts_millis_t scan_until_rate(Rate rate) {
+      while (true) {
+        ts_millis_t start = scan({});
+        if (ScanGovernor::rate() == rate) {
+          return start;
+        }
+      }
+    }
+};
+
+TEST_F(ScanGovernorTest, idle_slowsDownAfterTimeout) {
+  ASSERT_EQ(scan({D(kA)}), 100u);
+  // The release is activity as well, seen by the cycle starting at 105.
+  ASSERT_EQ(scan({U(kA)}), 104u);
+  ASSERT_EQ(ScanGovernor::rate(), Rate::FULL);
+
+  ASSERT_EQ(scan_until_rate(Rate::SLOW), 208u);
+  ASSERT_EQ(scan_until(260), (std::vector<ts_millis_t> { 224, 240, 256 }));
+}
+
+TEST_F(ScanGovernorTest, keyWhileSlow_restoresFullRate) {
+  ASSERT_EQ(scan_until_rate(Rate::SLOW), 200u);
+  ASSERT_EQ(scan({}), 216u);
+
+  // Pressed at 217, seen by the next slow scan.
+  inc_millis(1);
+  ASSERT_EQ(scan({D(kA)}), 232u);
+  ASSERT_EQ(ScanGovernor::rate(), Rate::FULL);
+  ASSERT_EQ(scan({H(kA)}), 236u);
+  ASSERT_EQ(scan({U(kA)}), 240u);
+}
+
+TEST_F(ScanGovernorTest, heldKey_slowsDown) {
+  ASSERT_EQ(scan({D(kA)}), 100u);
+  while (ScanGovernor::rate() == Rate::FULL) {
+    ASSERT_LE(scan({H(kA)}), 204u);
+  }
+  // The scan at 204 slowed down, the release is seen by the next slow scan.
+  ASSERT_EQ(scan({U(kA)}), 220u);
+  ASSERT_EQ(ScanGovernor::rate(), Rate::FULL);
+  ASSERT_EQ(scan_until_rate(Rate::SLOW), 324u);
+}
+
+TEST_F(ScanGovernorTest, suspend_slowsDownImmediately) {
+  scan({D(kA)});
+  scan({U(kA)});
+  ScanGovernor::hostSuspended();
+  ASSERT_EQ(ScanGovernor::rate(), Rate::SLOW);
+  ASSERT_EQ(scan({}), 124u);
+
+  ScanGovernor::hostResumed();
+  ASSERT_EQ(ScanGovernor::rate(), Rate::FULL);
+  ASSERT_EQ(scan({}), 128u);
+  ASSERT_EQ(scan_until_rate(Rate::SLOW), 228u);
+}
+
+}
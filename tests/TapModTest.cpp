@@ -1,5 +1,6 @@
 #include <gtest/gtest.h>
 #include <TapMod.h>
+#include <ReportGate.h>
 #include <kaleidoscope/key_defs.h>
 #include <kaleidoscope/addr.h>
 #include <FakeKeyboardBaseTest.h>
@@ -8,6 +9,8 @@
 namespace custom {
 
 using State = TapMod::State;
+using Event = TapMod::Event;
+using Action = TapMod::Action;
 
 // Test base class with most function definitions.
 class TapModTest : public FakeKeyboardBaseTest {
@@ -43,12 +46,55 @@ class TapModTest : public FakeKeyboardBaseTest {
 
   protected:
     static constexpr PosKey tm1 = PosKey { Key_TapMod01, 1, 1 };
+    static constexpr PosKey tm4 = PosKey { Key_TapMod04, 1, 4 };
     static constexpr PosKey kn1 = PosKey { Key_C, 2, 1 };
+    static constexpr PosKey kn2 = PosKey { Key_D, 2, 2 };
+    static constexpr PosKey kn3 = PosKey { Key_F, 3, 1 };
+
+    static FakeReport report(std::initializer_list<PosKey> keys) {
+      FakeReport r;
+      for (auto& k : keys) { r.insert(std::make_pair(k.row, k.col)); }
+      return r;
+    }
 
     static void verify_state(State s0, State s3) {
       ASSERT_EQ(TapMod::entries[0].state, s0);
       ASSERT_EQ(TapMod::entries[3].state, s3);
     }
+
+    /// Check the bitset of non-IDLE entries (of the first eight).
+    static void verify_active(uint8_t bits) {
+      ASSERT_EQ(TapMod::active[0], bits);
+    }
+
+    /// Check the timeouts of the first entry when it was last persisted.
+    static void verify_saved(uint16_t tap_ms, uint16_t active_ms) {
+      ASSERT_EQ(TapMod::saved[0].tap_ms, tap_ms);
+      ASSERT_EQ(TapMod::saved[0].active_ms, active_ms);
+    }
+
+    /// Tap `tm1` for `hold_ms` (at least one cycle), and press the next key `next_ms`
+    /// after the tap's press (at least one cycle after the release).
+    static void tap_then_key(ts_millis_t hold_ms, ts_millis_t next_ms) {
+      cycle({D(tm1)});
+      inc_millis(hold_ms - 20);
+      cycle({U(tm1)});
+      inc_millis(next_ms - hold_ms - 20);
+      cycle({D(kn1)});
+      cycle({U(kn1)});
+      discard_events();
+    }
+
+    /// Hold `tm1` for `hold_ms` without any other key, then wait until it expired.
+    static void hold_alone(ts_millis_t hold_ms) {
+      cycle({D(tm1)});
+      inc_millis(hold_ms - 40);
+      cycle({H(tm1)});
+      cycle({U(tm1)});
+      inc_millis(500);
+      cycle({});
+      discard_events();
+    }
 };
 
 TEST_F(TapModTest, tmKeyDown_actualKeyDown) {
@@ -165,4 +211,419 @@ TEST_F(TapModTest, preQueue_tmKeyReleasedShort_stateIdle) {
   verify_state(State::IDLE, State::IDLE);
 }
 
+TEST_F(TapModTest, preQueue_secondRealKey_stateQueuing) {
+  cycle({D(tm1)});
+  cycle({H(tm1), D(kn1)});
+  verify({ED(Key_E), ReportSent, EH(Key_E), ED(Key_C)});
+  cycle({H(tm1), H(kn1), D(kn2)});
+  verify({EH(Key_E), EH(Key_C), Consumed});
+  verify_state(State::QUEUING, State::IDLE);
+  cycle({H(tm1), H(kn1), H(kn2)});
+  verify({EH(Key_E), EH(Key_C), Consumed});
+}
+
+TEST_F(TapModTest, queuing_tmKeyReleased_replaysWithoutActual) {
+  cycle({D(tm1)});
+  cycle({H(tm1), D(kn1)});
+  cycle({H(tm1), H(kn1), D(kn2)});
+  verify({ED(Key_E), ReportSent, EH(Key_E), ED(Key_C), ReportSent,
+          EH(Key_E), EH(Key_C), Consumed});
+  cycle({U(tm1), H(kn1), H(kn2)});
+  verify({EU(Key_E), EH(Key_C), Consumed, ED(kn2.noKey())});
+  verify_state(State::IDLE, State::IDLE);
+  cycle({H(kn1), H(kn2)});
+  verify({EH(Key_C), EH(Key_D)});
+}
+
+TEST_F(TapModTest, queuing_timeout_replaysWithActual) {
+  cycle({D(tm1)});
+  cycle({H(tm1), D(kn1)});
+  cycle({H(tm1), H(kn1), D(kn2)});
+  verify({ED(Key_E), ReportSent, EH(Key_E), ED(Key_C), ReportSent,
+          EH(Key_E), EH(Key_C), Consumed});
+  inc_millis(200);
+  cycle({H(tm1), H(kn1), H(kn2)});
+  verify({EH(Key_E), EH(Key_C), Consumed, ED(kn2.noKey())});
+  verify_state(State::PRESSED_REAL, State::IDLE);
+}
+
+TEST_F(TapModTest, queuing_tapOfQueuedKey_keepsReports) {
+  cycle({D(tm1)});
+  cycle({H(tm1), D(kn1)});
+  cycle({H(tm1), H(kn1), D(kn2)});
+  cycle({H(tm1), U(kn1), U(kn2)});
+  verify({ED(Key_E), ReportSent, EH(Key_E), ED(Key_C), ReportSent,
+          EH(Key_E), EH(Key_C), Consumed, ReportSent,
+          EH(Key_E), Consumed, Consumed});
+  cycle({U(tm1)});
+  // Each replayed report is rebuilt with the keys still held, including those whose
+  // release is queued.
+  verify({EU(Key_E),
+          EH(kn1.noKey()), ED(kn2.noKey()), ReportSent,
+          EH(kn2.noKey()), EU(kn1.noKey()), ReportSent,
+          EU(kn2.noKey())});
+  verify_state(State::IDLE, State::IDLE);
+}
+
+TEST_F(TapModTest, queuing_full_decidesHold) {
+  cycle({D(tm1)});
+  cycle({H(tm1), D(kn1)});
+  // Fast enough to stay within the tap timeout.
+  for (int i = 0; i < 8; i++) {
+    cycle({H(tm1), H(kn1), D(kn2)}, 4);
+    cycle({H(tm1), H(kn1), U(kn2)}, 4);
+  }
+  discard_events();
+  verify_state(State::QUEUING, State::IDLE);
+
+  cycle({H(tm1), H(kn1), D(kn2)}, 4);
+  verify_state(State::PRESSED_REAL, State::IDLE);
+  // The queue is replayed after the scan, then the new press.
+  std::vector<FakeKeyEventResultExpectation> expected { EH(Key_E), EH(Key_C), Consumed };
+  for (int i = 0; i < 8; i++) {
+    expected.insert(expected.end(), {ED(kn2.noKey()), ReportSent,
+                                     EH(tm1.noKey()), EH(kn1.noKey()), EU(kn2.noKey()), ReportSent,
+                                     EH(tm1.noKey()), EH(kn1.noKey())});
+  }
+  expected.push_back(ED(kn2.noKey()));
+  verify(expected);
+}
+
+TEST_F(TapModTest, queuing_full_keepsLaterHeldKey) {
+  cycle({D(kn3)});
+  cycle({D(tm1), H(kn3)});
+  cycle({H(tm1), D(kn1), H(kn3)});
+  for (int i = 0; i < 8; i++) {
+    cycle({H(tm1), H(kn1), D(kn2), H(kn3)}, 4);
+    cycle({H(tm1), H(kn1), U(kn2), H(kn3)}, 4);
+  }
+  cycle({H(tm1), H(kn1), D(kn2), H(kn3)}, 4);
+  discard_events();
+  verify_state(State::PRESSED_REAL, State::IDLE);
+
+  // `kn3` is scanned after the event that overflows the queue, and stays in every
+  // replayed report. Each queued tap of `kn2` gets its own reports.
+  std::vector<FakeReport> expected {
+    report({kn3}), report({tm1, kn3}), report({tm1, kn1, kn3})
+  };
+  for (int i = 0; i < 8; i++) {
+    expected.push_back(report({tm1, kn1, kn2, kn3}));
+    expected.push_back(report({tm1, kn1, kn3}));
+  }
+  expected.push_back(report({tm1, kn1, kn2, kn3}));
+  ASSERT_EQ(sent_reports(), expected);
+}
+
+TEST_F(TapModTest, nestedTap_waitsForTimeoutByDefault) {
+  cycle({D(tm1)});
+  ts_millis_t pressed_ms = Kaleidoscope_::millisAtCycleStart();
+  cycle({H(tm1), D(kn1)});
+  cycle({H(tm1), H(kn1), D(kn2)});
+  cycle({H(tm1), H(kn1), U(kn2)});
+  verify({ED(Key_E), ReportSent, EH(Key_E), ED(Key_C), ReportSent,
+          EH(Key_E), EH(Key_C), Consumed, ReportSent,
+          EH(Key_E), EH(Key_C), Consumed});
+  verify_state(State::QUEUING, State::IDLE);
+
+  inc_millis(120);
+  cycle({H(tm1), H(kn1)});
+  verify({EH(Key_E), EH(Key_C), ED(kn2.noKey()), ReportSent,
+          EH(tm1.noKey()), EH(kn1.noKey()), EU(kn2.noKey())});
+  ASSERT_GT(Kaleidoscope_::millisAtCycleStart() - pressed_ms, 180u);
+}
+
+TEST_F(TapModTest, permissiveHold_nestedTap_emitsImmediately) {
+  TapMod::setPermissiveHold(true);
+  cycle({D(tm1)});
+  ts_millis_t pressed_ms = Kaleidoscope_::millisAtCycleStart();
+  cycle({H(tm1), D(kn1)});
+  cycle({H(tm1), H(kn1), D(kn2)});
+  verify({ED(Key_E), ReportSent, EH(Key_E), ED(Key_C), ReportSent,
+          EH(Key_E), EH(Key_C), Consumed});
+  cycle({H(tm1), H(kn1), U(kn2)});
+  verify({EH(Key_E), EH(Key_C), Consumed, ED(kn2.noKey()), ReportSent,
+          EH(tm1.noKey()), EH(kn1.noKey()), EU(kn2.noKey())});
+  verify_state(State::PRESSED_REAL, State::IDLE);
+  ASSERT_LE(Kaleidoscope_::millisAtCycleStart() - pressed_ms, 60u);
+}
+
+TEST_F(TapModTest, permissiveHold_firstKeyTapped_nextKeyNotQueued) {
+  TapMod::setPermissiveHold(true);
+  cycle({D(tm1)});
+  ts_millis_t pressed_ms = Kaleidoscope_::millisAtCycleStart();
+  cycle({H(tm1), D(kn1)});
+  cycle({H(tm1), U(kn1)});
+  verify({ED(Key_E), ReportSent, EH(Key_E), ED(Key_C), ReportSent,
+          EH(Key_E), EU(Key_C)});
+  verify_state(State::PRESSED_REAL, State::IDLE);
+
+  cycle({H(tm1), D(kn2)});
+  verify({EH(Key_E), ED(Key_D)});
+  ASSERT_LE(Kaleidoscope_::millisAtCycleStart() - pressed_ms, 60u);
+}
+
+TEST_F(TapModTest, permissiveHold_keyHeldBefore_notNested) {
+  TapMod::setPermissiveHold(true);
+  cycle({D(kn1)});
+  cycle({H(kn1), D(tm1)});
+  cycle({H(kn1), H(tm1), D(kn2)});
+  cycle({U(kn1), H(tm1), H(kn2)});
+  discard_events();
+  // Only kn2 was pressed while tm1 is held.
+  verify_state(State::PRESSED_PRE_QUEUE, State::IDLE);
+  cycle({H(tm1), U(kn2)});
+  verify({EH(Key_E), EU(Key_D)});
+  verify_state(State::PRESSED_REAL, State::IDLE);
+}
+
+TEST_F(TapModTest, transitions_complete) {
+  for (uint8_t s = 0; s < TapMod::STATE_CNT; s++) {
+    for (uint8_t e = 0; e < TapMod::EVENT_CNT; e++) {
+      TapMod::Transition t = TapMod::transition((State)s, (Event)e);
+      ASSERT_NE(t.action, Action::MISSING) << "state " << (int)s << ", event " << (int)e;
+      ASSERT_LT((uint8_t)t.next, TapMod::STATE_CNT);
+      if (t.action == Action::ERROR) {
+        ASSERT_EQ(t.next, (State)s);
+      }
+      if (s == (uint8_t)State::IDLE && t.next != State::IDLE) {
+        ASSERT_EQ(t.action, Action::PRESS);
+      }
+    }
+
+    if (TapMod::timer((State)s) != TapMod::Timer::NONE) {
+      ASSERT_NE(TapMod::transition((State)s, Event::TIMEOUT).next, (State)s);
+    }
+  }
+}
+
+TEST_F(TapModTest, transitions_everyStateReachesIdle) {
+  bool reaches_idle[TapMod::STATE_CNT] = { false };
+  reaches_idle[(uint8_t)State::IDLE] = true;
+
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (uint8_t s = 0; s < TapMod::STATE_CNT; s++) {
+      for (uint8_t e = 0; e < TapMod::EVENT_CNT && !reaches_idle[s]; e++) {
+        if (reaches_idle[(uint8_t)TapMod::transition((State)s, (Event)e).next]) {
+          reaches_idle[s] = true;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  for (uint8_t s = 0; s < TapMod::STATE_CNT; s++) {
+    ASSERT_TRUE(reaches_idle[s]) << "state " << (int)s;
+  }
+}
+
+TEST_F(TapModTest, activeEntries_onlyNonIdle) {
+  verify_active(0);
+  cycle({D(tm4)});
+  verify({ED(Key_I)});
+  verify_active(0x08);
+  cycle({H(tm4), D(tm1)});
+  verify({EH(Key_I), ED(Key_E)});
+  verify_active(0x09);
+  inc_millis(200);
+  cycle({U(tm4), H(tm1)});
+  verify({EU(Key_I), EH(Key_E)});
+  verify_active(0x01);
+  cycle({U(tm1)});
+  verify({EU(Key_E)});
+  verify_state(State::IDLE, State::IDLE);
+  verify_active(0);
+}
+
+TEST_F(TapModTest, adaptive_disabled_keepsDefaults) {
+  for (int i = 0; i < 10; i++) {
+    tap_then_key(60, 120);
+  }
+  ASSERT_EQ(TapMod::tapTime(0), 180);
+  ASSERT_EQ(TapMod::activeTime(0), 320);
+  ASSERT_EQ(TapMod::timing(0).tap_avg8, 0);
+}
+
+TEST_F(TapModTest, adaptive_fastTaps_narrowWindows) {
+  TapMod::setAdaptive(true);
+  for (int i = 0; i < 20; i++) {
+    tap_then_key(i % 2 ? 60 : 80, i % 2 ? 120 : 140);
+  }
+
+  ASSERT_GE(TapMod::tapTime(0), 100);
+  ASSERT_LT(TapMod::tapTime(0), 150);
+  ASSERT_GE(TapMod::activeTime(0), 150);
+  ASSERT_LT(TapMod::activeTime(0), 250);
+  // The other entries learned nothing.
+  ASSERT_EQ(TapMod::tapTime(3), 180);
+
+  // Slower than the learned taps, so a real press now.
+  cycle({D(tm1)});
+  verify({ED(Key_E)});
+  inc_millis(130);
+  cycle({H(tm1)});
+  verify({EH(Key_E)});
+  verify_state(State::PRESSED_REAL, State::IDLE);
+  cycle({U(tm1)});
+  verify({EU(Key_E)});
+
+  // And a tap waits less for the next key.
+  cycle({D(tm1)});
+  verify({ED(Key_E)});
+  cycle({U(tm1)});
+  verify({Consumed, EH(Key_E)});
+  inc_millis(230);
+  cycle({});
+  verify({EU(Key_E)});
+  verify_state(State::IDLE, State::IDLE);
+}
+
+TEST_F(TapModTest, adaptive_slowTaps_widenTapTime) {
+  TapMod::setAdaptive(true);
+  for (int i = 0; i < 10; i++) {
+    hold_alone(220);
+  }
+
+  ASSERT_EQ(TapMod::tapTime(0), 250);
+
+  // Longer than the default timeout, but still a tap.
+  cycle({D(tm1)});
+  verify({ED(Key_E)});
+  inc_millis(180);
+  cycle({U(tm1)});
+  verify({Consumed, EH(Key_E)});
+  verify_state(State::PRESSED_DELAYED, State::IDLE);
+}
+
+TEST_F(TapModTest, adaptive_modifierUse_learnsNothing) {
+  TapMod::setAdaptive(true);
+  cycle({D(tm1)});
+  cycle({H(tm1), D(kn1)});
+  inc_millis(200);
+  cycle({H(tm1), H(kn1)});
+  cycle({U(tm1), U(kn1)});
+  verify_state(State::IDLE, State::IDLE);
+  ASSERT_EQ(TapMod::timing(0).tap_avg8, 0);
+  ASSERT_EQ(TapMod::timing(0).active_avg8, 0);
+}
+
+TEST_F(TapModTest, adaptive_persistsAfterDrift) {
+  TapMod::setAdaptive(true);
+  tap_then_key(60, 120);
+  // The first sample moves the windows from the defaults.
+  uint16_t tap_ms = TapMod::tapTime(0);
+  uint16_t active_ms = TapMod::activeTime(0);
+  verify_saved(tap_ms, active_ms);
+
+  for (int i = 0; i < 20; i++) {
+    tap_then_key(60, 120);
+    uint16_t now_tap_ms = TapMod::tapTime(0);
+    uint16_t now_active_ms = TapMod::activeTime(0);
+    if (abs(now_tap_ms - tap_ms) >= 8 || abs(now_active_ms - active_ms) >= 8) {
+      tap_ms = now_tap_ms;
+      active_ms = now_active_ms;
+    }
+    verify_saved(tap_ms, active_ms);
+  }
+  ASSERT_LT(tap_ms, 180);
+}
+
+TEST_F(TapModTest, adaptive_restoresTiming) {
+  TapMod::setAdaptive(true);
+  for (int i = 0; i < 20; i++) {
+    tap_then_key(60, 120);
+  }
+  TapMod::Timing timing = TapMod::timing(0);
+  uint16_t tap_ms = TapMod::tapTime(0);
+  uint16_t active_ms = TapMod::activeTime(0);
+
+  // Nothing learned yet.
+  ASSERT_EQ(TapMod::setTiming(0, TapMod::Timing { 0, 0, 0, 0 }), EventHandlerResult::OK);
+  ASSERT_EQ(TapMod::tapTime(0), 180);
+
+  // Erased EEPROM.
+  TapMod::Timing erased = { 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF };
+  ASSERT_EQ(TapMod::setTiming(0, erased), EventHandlerResult::ERROR);
+  ASSERT_EQ(TapMod::tapTime(0), 180);
+
+  ASSERT_EQ(TapMod::setTiming(0, timing), EventHandlerResult::OK);
+  ASSERT_EQ(TapMod::tapTime(0), tap_ms);
+  ASSERT_EQ(TapMod::activeTime(0), active_ms);
+  verify_saved(tap_ms, active_ms);
+}
+
+class TapModReportGateTest : public FakeKeyboardBaseTest {
+  private:
+    static EventHandlerResult tap_mod_on_keyswitch(Key& mappedKey, uint8_t row, uint8_t col, uint8_t keyState) {
+      return ::TapMod.onKeyswitchEvent(mappedKey, row, col, keyState);
+    }
+
+    static EventHandlerResult tap_mod_before_reporting() {
+      return ::TapMod.beforeReportingState();
+    }
+
+    static EventHandlerResult tap_mod_before_cycle() {
+      return ::TapMod.beforeEachCycle();
+    }
+
+    static EventHandlerResult gate_on_keyswitch(Key& mappedKey, uint8_t row, uint8_t col, uint8_t keyState) {
+      return ::ReportGate.onKeyswitchEvent(mappedKey, row, col, keyState);
+    }
+
+    static EventHandlerResult gate_after_cycle() {
+      return ::ReportGate.afterEachCycle();
+    }
+
+  public:
+    void SetUp() override {
+      FakeKeyboardBaseTest::SetUp();
+      FakeKeyboardBaseTest::add_keyswitch_handler(tap_mod_on_keyswitch);
+      FakeKeyboardBaseTest::add_before_reporting_handler(tap_mod_before_reporting);
+      FakeKeyboardBaseTest::add_before_cycle_handler(tap_mod_before_cycle);
+      FakeKeyboardBaseTest::add_keyswitch_handler(gate_on_keyswitch);
+      FakeKeyboardBaseTest::add_after_cycle_handler(gate_after_cycle);
+
+      TapMod::reset();
+      TapMod::setActual(0, Key_E);
+      ReportGate::reset();
+      ReportGate::setMinInterval(1);
+    }
+
+  protected:
+    static constexpr PosKey tm1 = PosKey { Key_TapMod01, 1, 1 };
+    static constexpr PosKey kn1 = PosKey { Key_C, 2, 1 };
+    static constexpr PosKey kn2 = PosKey { Key_D, 2, 2 };
+
+    static FakeReport report(std::initializer_list<PosKey> keys) {
+      FakeReport r;
+      for (auto& k : keys) { r.insert(std::make_pair(k.row, k.col)); }
+      return r;
+    }
+
+    static void verify_queued(size_t len) {
+      ASSERT_EQ(TapMod::queue_len, len);
+    }
+};
+
+TEST_F(TapModReportGateTest, minInterval_replaysQueueOverCycles) {
+  cycle({D(tm1)}, 4);
+  cycle({H(tm1), D(kn1)}, 4);
+  cycle({H(tm1), H(kn1), D(kn2)}, 4);
+  cycle({H(tm1), U(kn1), U(kn2)}, 4);
+  cycle({U(tm1)}, 4);
+  verify_queued(2);
+  cycle({}, 4);
+  verify_queued(1);
+  cycle({}, 4);
+  verify_queued(0);
+  discard_events();
+
+  // One replayed event per cycle, so the host polls each of them.
+  std::vector<FakeReport> replayed { report({kn1, kn2}), report({kn2}), report({}) };
+  std::vector<FakeReport> sent = sent_reports();
+  ASSERT_TRUE(std::equal(replayed.rbegin(), replayed.rend(), sent.rbegin()));
+  ASSERT_EQ(polled_reports(1), sent);
+  ASSERT_EQ(ReportGate::metrics().early, 0u);
+}
+
 }